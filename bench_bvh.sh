@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Compares the SAH and LBVH builders on the mesh heavy scenes, the raytracer
+# reports the build time and the render time of every camera separately.
+# Usage: ./bench_bvh.sh [scene.xml ...]
+
+# Directory containing the input files
+xml_dir="$(dirname "$0")/test_scenes/inputs"
+
+# Path to the raytracer executable
+raytracer="$(cd "$(dirname "$0")" && pwd)/raytracer"
+
+scenes=("$@")
+if [ ${#scenes[@]} -eq 0 ]; then
+    scenes=("$xml_dir/bunny.xml" "$xml_dir/horse_and_mug.xml")
+fi
+
+# The images are written to a scratch directory so the tree stays clean
+out_dir="$(mktemp -d)"
+trap 'rm -rf "$out_dir"' EXIT
+
+printf "%-20s %-6s %12s %12s\n" "scene" "bvh" "build (ms)" "render (ms)"
+for xml_file in "${scenes[@]}"; do
+    xml_file="$(cd "$(dirname "$xml_file")" && pwd)/$(basename "$xml_file")"
+    for builder in sah lbvh; do
+        output="$(cd "$out_dir" && "$raytracer" --bvh "$builder" "$xml_file")"
+
+        build_ms=$(echo "$output" | sed -n 's/^BVH build ([a-z]*): \([0-9.]*\) ms.*/\1/p')
+        render_ms=$(echo "$output" | sed -n 's/^Render .*: \([0-9.]*\) ms$/\1/p' |
+            awk '{ sum += $1 } END { printf "%.1f", sum }')
+
+        printf "%-20s %-6s %12.1f %12s\n" "$(basename "$xml_file")" "$builder" \
+            "$build_ms" "$render_ms"
+    done
+done
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Measures the scene parsing throughput of both XML loaders, the raytracer
+# stops right after loading so the numbers only cover the parse.
+# Usage: ./bench_parse.sh [scene.xml ...]
+
+# Directory containing the input files
+xml_dir="$(dirname "$0")/test_scenes/inputs"
+
+# Path to the raytracer executable
+raytracer="$(cd "$(dirname "$0")" && pwd)/raytracer"
+
+# Every loader runs this many times, the best run is reported
+runs=5
+
+scenes=("$@")
+if [ ${#scenes[@]} -eq 0 ]; then
+    scenes=("$xml_dir/car.xml" "$xml_dir/horse_and_mug.xml")
+fi
+
+printf "%-20s %-5s %10s %10s %10s\n" "scene" "xml" "size (MB)" "load (ms)" "MB/s"
+for xml_file in "${scenes[@]}"; do
+    size_mb=$(awk -v bytes="$(stat -c %s "$xml_file")" 'BEGIN { printf "%.2f", bytes / 1048576 }')
+    for loader in mmap dom; do
+        best_ms=""
+        for ((run = 0; run < runs; ++run)); do
+            ms=$("$raytracer" --load-only --xml "$loader" "$xml_file" |
+                sed -n 's/^Scene load ([a-z]*): \([0-9.]*\) ms$/\1/p')
+            best_ms=$(awk -v a="$best_ms" -v b="$ms" 'BEGIN { print (a == "" || b < a) ? b : a }')
+        done
+
+        printf "%-20s %-5s %10s %10.1f %10.1f\n" "$(basename "$xml_file")" "$loader" \
+            "$size_mb" "$best_ms" "$(awk -v s="$size_mb" -v t="$best_ms" 'BEGIN { print s / (t / 1000) }')"
+    done
+done
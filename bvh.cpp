@@ -0,0 +1,766 @@
+#include "paged_geometry.h"
+#include "parser.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+
+namespace {
+
+const int BIN_COUNT = 16;
+// leaves fit in one call of the widest triangle kernel
+const int MAX_LEAF_SIZE = 16;
+
+// relative costs of a box test and a primitive test used by the SAH
+const float TRAVERSAL_COST = 1.0f;
+const float INTERSECTION_COST = 1.0f;
+
+// ranges larger than this are binned by all threads, smaller ones are built
+// as a single subtree task
+const int PARALLEL_BINNING_THRESHOLD = 1 << 15;
+const int SUBTREE_TASK_THRESHOLD = 1 << 10;
+const int CHUNK_SIZE = 1 << 13;
+
+struct Bounds {
+  parser::Vec3f box_min;
+  parser::Vec3f box_max;
+};
+
+// binary node produced by the builders before it is collapsed
+struct BVHNode {
+  parser::Vec3f box_min;
+  parser::Vec3f box_max;
+  int left_first; // left child for inner nodes, first primitive for leaves
+  int prim_count; // 0 for inner nodes, the right child is left_first + 1
+};
+
+inline Bounds empty_bounds() {
+  const float inf = std::numeric_limits<float>::infinity();
+  return {{inf, inf, inf}, {-inf, -inf, -inf}};
+}
+
+inline void grow(Bounds &b, const parser::Vec3f &p) {
+  b.box_min = {std::min(b.box_min.x, p.x), std::min(b.box_min.y, p.y),
+               std::min(b.box_min.z, p.z)};
+  b.box_max = {std::max(b.box_max.x, p.x), std::max(b.box_max.y, p.y),
+               std::max(b.box_max.z, p.z)};
+}
+
+inline void grow(Bounds &b, const Bounds &other) {
+  b.box_min = {std::min(b.box_min.x, other.box_min.x),
+               std::min(b.box_min.y, other.box_min.y),
+               std::min(b.box_min.z, other.box_min.z)};
+  b.box_max = {std::max(b.box_max.x, other.box_max.x),
+               std::max(b.box_max.y, other.box_max.y),
+               std::max(b.box_max.z, other.box_max.z)};
+}
+
+inline float surface_area(const Bounds &b) {
+  if (b.box_min.x > b.box_max.x) {
+    return 0.0f;
+  }
+  const parser::Vec3f e = subtract_vectors(b.box_max, b.box_min);
+  return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+inline float axis_value(const parser::Vec3f &v, int axis) {
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+struct BuildData {
+  std::vector<Bounds> bounds;           // indexed by original primitive
+  std::vector<parser::Vec3f> centroids; // indexed by original primitive
+  std::vector<int> order;               // primitive permutation
+  std::vector<BVHNode> nodes;
+  std::atomic<int> node_count;
+  ThreadPool *pool;
+};
+
+struct Bins {
+  Bounds bounds[3][BIN_COUNT];
+  int counts[3][BIN_COUNT];
+};
+
+struct Split {
+  int axis;
+  int bin;
+  float cost;
+};
+
+inline void clear_bins(Bins &bins) {
+  for (int axis = 0; axis < 3; ++axis) {
+    for (int b = 0; b < BIN_COUNT; ++b) {
+      bins.bounds[axis][b] = empty_bounds();
+      bins.counts[axis][b] = 0;
+    }
+  }
+}
+
+inline void merge_bins(Bins &bins, const Bins &other) {
+  for (int axis = 0; axis < 3; ++axis) {
+    for (int b = 0; b < BIN_COUNT; ++b) {
+      grow(bins.bounds[axis][b], other.bounds[axis][b]);
+      bins.counts[axis][b] += other.counts[axis][b];
+    }
+  }
+}
+
+inline float bin_scale(const Bounds &centroid_bounds, int axis) {
+  const float extent = axis_value(centroid_bounds.box_max, axis) -
+                       axis_value(centroid_bounds.box_min, axis);
+  return extent > 0.0f ? BIN_COUNT / extent : 0.0f;
+}
+
+inline int bin_index(float centroid, float axis_min, float scale) {
+  int bin = static_cast<int>((centroid - axis_min) * scale);
+  return std::max(0, std::min(BIN_COUNT - 1, bin));
+}
+
+void range_bounds(const BuildData &data, int first, int last, Bounds &node,
+                  Bounds &centroid) {
+  for (int i = first; i < last; ++i) {
+    grow(node, data.bounds[data.order[i]]);
+    grow(centroid, data.centroids[data.order[i]]);
+  }
+}
+
+void bin_range(const BuildData &data, int first, int last,
+               const Bounds &centroid_bounds, Bins &bins) {
+  float scale[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    scale[axis] = bin_scale(centroid_bounds, axis);
+  }
+  for (int i = first; i < last; ++i) {
+    const int p = data.order[i];
+    for (int axis = 0; axis < 3; ++axis) {
+      const int b = bin_index(axis_value(data.centroids[p], axis),
+                              axis_value(centroid_bounds.box_min, axis),
+                              scale[axis]);
+      bins.counts[axis][b]++;
+      grow(bins.bounds[axis][b], data.bounds[p]);
+    }
+  }
+}
+
+// sweeps the bins of every axis and returns the cheapest SAH split, the cost
+// is left as infinity if the centroids cannot be separated
+Split evaluate_bins(const Bins &bins, const Bounds &centroid_bounds,
+                    float node_area) {
+  Split best = {-1, 0, std::numeric_limits<float>::infinity()};
+
+  for (int axis = 0; axis < 3; ++axis) {
+    if (bin_scale(centroid_bounds, axis) == 0.0f) {
+      continue;
+    }
+
+    // areas and counts to the right of every split plane
+    float right_area[BIN_COUNT - 1];
+    int right_count[BIN_COUNT - 1];
+    Bounds right = empty_bounds();
+    int right_sum = 0;
+    for (int b = BIN_COUNT - 1; b > 0; --b) {
+      grow(right, bins.bounds[axis][b]);
+      right_sum += bins.counts[axis][b];
+      right_area[b - 1] = surface_area(right);
+      right_count[b - 1] = right_sum;
+    }
+
+    Bounds left = empty_bounds();
+    int left_sum = 0;
+    for (int b = 0; b < BIN_COUNT - 1; ++b) {
+      grow(left, bins.bounds[axis][b]);
+      left_sum += bins.counts[axis][b];
+      if (left_sum == 0 || right_count[b] == 0) {
+        continue;
+      }
+      const float cost =
+          TRAVERSAL_COST + INTERSECTION_COST *
+                               (left_sum * surface_area(left) +
+                                right_count[b] * right_area[b]) /
+                               node_area;
+      if (cost < best.cost) {
+        best = {axis, b, cost};
+      }
+    }
+  }
+  return best;
+}
+
+// returns the first primitive of the right child, or -1 for a leaf
+int split_range(BuildData &data, int first, int count, int depth,
+                const Bounds &centroid_bounds, const Split &split) {
+  if (count == 1 || depth >= parser::BVH_MAX_DEPTH) {
+    return -1;
+  }
+  const float leaf_cost = INTERSECTION_COST * count;
+  if (count <= MAX_LEAF_SIZE && split.cost >= leaf_cost) {
+    return -1;
+  }
+
+  int mid = first;
+  if (split.axis >= 0) {
+    const int axis = split.axis;
+    const float axis_min = axis_value(centroid_bounds.box_min, axis);
+    const float scale = bin_scale(centroid_bounds, axis);
+    mid = std::partition(data.order.begin() + first,
+                         data.order.begin() + first + count,
+                         [&](int p) {
+                           return bin_index(axis_value(data.centroids[p], axis),
+                                            axis_min, scale) <= split.bin;
+                         }) -
+          data.order.begin();
+  }
+
+  // the centroids are coincident, split the range in half to bound the leaves
+  if (mid == first || mid == first + count) {
+    if (count <= MAX_LEAF_SIZE) {
+      return -1;
+    }
+    mid = first + count / 2;
+  }
+  return mid;
+}
+
+// fills in the node and returns the index of its left child, or -1 for a leaf
+int make_node(BuildData &data, int node_index, int first, int count,
+              const Bounds &node_bounds, int mid) {
+  BVHNode &node = data.nodes[node_index];
+  node.box_min = node_bounds.box_min;
+  node.box_max = node_bounds.box_max;
+  if (mid < 0) {
+    node.left_first = first;
+    node.prim_count = count;
+    return -1;
+  }
+  node.left_first = data.node_count.fetch_add(2);
+  node.prim_count = 0;
+  return node.left_first;
+}
+
+void subdivide(BuildData &data, int node_index, int first, int count,
+               int depth) {
+  Bounds node_bounds = empty_bounds();
+  Bounds centroid_bounds = empty_bounds();
+  range_bounds(data, first, first + count, node_bounds, centroid_bounds);
+
+  Bins bins;
+  clear_bins(bins);
+  bin_range(data, first, first + count, centroid_bounds, bins);
+  const Split split =
+      evaluate_bins(bins, centroid_bounds, surface_area(node_bounds));
+
+  const int mid =
+      split_range(data, first, count, depth, centroid_bounds, split);
+  const int left_index =
+      make_node(data, node_index, first, count, node_bounds, mid);
+  if (left_index < 0) {
+    return;
+  }
+  subdivide(data, left_index, first, mid - first, depth + 1);
+  subdivide(data, left_index + 1, mid, first + count - mid, depth + 1);
+}
+
+// top levels of the tree: the bounds and bins of large ranges are computed by
+// all threads, smaller ranges become independent subtree tasks
+void subdivide_parallel(BuildData &data, TaskGroup &group, int node_index,
+                        int first, int count, int depth) {
+  if (count < PARALLEL_BINNING_THRESHOLD) {
+    if (count < SUBTREE_TASK_THRESHOLD) {
+      subdivide(data, node_index, first, count, depth);
+    } else {
+      data.pool->submit(group, [&data, node_index, first, count, depth]() {
+        subdivide(data, node_index, first, count, depth);
+      });
+    }
+    return;
+  }
+
+  const int chunk_count = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  std::vector<Bounds> chunk_node(chunk_count, empty_bounds());
+  std::vector<Bounds> chunk_centroid(chunk_count, empty_bounds());
+  data.pool->parallel_for(0, chunk_count, 1, [&](int c, int) {
+    const int chunk_first = first + c * CHUNK_SIZE;
+    range_bounds(data, chunk_first,
+                 std::min(first + count, chunk_first + CHUNK_SIZE),
+                 chunk_node[c], chunk_centroid[c]);
+  });
+  Bounds node_bounds = empty_bounds();
+  Bounds centroid_bounds = empty_bounds();
+  for (int c = 0; c < chunk_count; ++c) {
+    grow(node_bounds, chunk_node[c]);
+    grow(centroid_bounds, chunk_centroid[c]);
+  }
+
+  std::vector<Bins> chunk_bins(chunk_count);
+  data.pool->parallel_for(0, chunk_count, 1, [&](int c, int) {
+    const int chunk_first = first + c * CHUNK_SIZE;
+    clear_bins(chunk_bins[c]);
+    bin_range(data, chunk_first,
+              std::min(first + count, chunk_first + CHUNK_SIZE),
+              centroid_bounds, chunk_bins[c]);
+  });
+  Bins bins = chunk_bins[0];
+  for (int c = 1; c < chunk_count; ++c) {
+    merge_bins(bins, chunk_bins[c]);
+  }
+  const Split split =
+      evaluate_bins(bins, centroid_bounds, surface_area(node_bounds));
+
+  const int mid =
+      split_range(data, first, count, depth, centroid_bounds, split);
+  const int left_index =
+      make_node(data, node_index, first, count, node_bounds, mid);
+  if (left_index < 0) {
+    return;
+  }
+  subdivide_parallel(data, group, left_index, first, mid - first, depth + 1);
+  subdivide_parallel(data, group, left_index + 1, mid, first + count - mid,
+                     depth + 1);
+}
+
+// LBVH: primitives are sorted by the Morton code of their centroid and the
+// hierarchy is read off the sorted codes (Karras 2012), trading tree quality
+// for a build that is linear in the primitive count
+
+const int MORTON_63_THRESHOLD = 1 << 18;
+const int RADIX_BITS = 8;
+const int RADIX_SIZE = 1 << RADIX_BITS;
+
+// spreads the lower 21 bits of v so that two zero bits follow each bit
+inline uint64_t expand_bits(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8) & 0x100f00f00f00f00fULL;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2) & 0x1249249249249249ULL;
+  return v;
+}
+
+inline uint64_t morton_code(const parser::Vec3f &p, const Bounds &bounds,
+                            int bits_per_axis) {
+  const float cells = static_cast<float>((1 << bits_per_axis) - 1);
+  uint64_t code = 0;
+  for (int axis = 0; axis < 3; ++axis) {
+    const float axis_min = axis_value(bounds.box_min, axis);
+    const float extent = axis_value(bounds.box_max, axis) - axis_min;
+    float x = extent > 0.0f ? (axis_value(p, axis) - axis_min) / extent : 0.0f;
+    x = std::max(0.0f, std::min(1.0f, x));
+    code |= expand_bits(static_cast<uint64_t>(x * cells)) << (2 - axis);
+  }
+  return code;
+}
+
+// LSD radix sort of (code, primitive) pairs, every pass builds per chunk
+// histograms in parallel and then scatters the chunks in parallel
+void radix_sort(ThreadPool &pool, std::vector<uint64_t> &codes,
+                std::vector<int> &values, int key_bits) {
+  const int count = codes.size();
+  const int chunk_count = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  std::vector<uint64_t> codes_out(count);
+  std::vector<int> values_out(count);
+  std::vector<int> offsets(chunk_count * RADIX_SIZE);
+
+  for (int shift = 0; shift < key_bits; shift += RADIX_BITS) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+    pool.parallel_for(0, chunk_count, 1, [&](int c, int) {
+      int *histogram = &offsets[c * RADIX_SIZE];
+      const int last = std::min(count, (c + 1) * CHUNK_SIZE);
+      for (int i = c * CHUNK_SIZE; i < last; ++i) {
+        histogram[(codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+      }
+    });
+
+    // digit major prefix sum keeps the sort stable across chunks
+    int sum = 0;
+    bool single_digit = false;
+    for (int digit = 0; digit < RADIX_SIZE; ++digit) {
+      int digit_total = 0;
+      for (int c = 0; c < chunk_count; ++c) {
+        const int n = offsets[c * RADIX_SIZE + digit];
+        offsets[c * RADIX_SIZE + digit] = sum;
+        sum += n;
+        digit_total += n;
+      }
+      single_digit = single_digit || digit_total == count;
+    }
+    if (single_digit) {
+      continue;
+    }
+
+    pool.parallel_for(0, chunk_count, 1, [&](int c, int) {
+      int *offset = &offsets[c * RADIX_SIZE];
+      const int last = std::min(count, (c + 1) * CHUNK_SIZE);
+      for (int i = c * CHUNK_SIZE; i < last; ++i) {
+        const int position = offset[(codes[i] >> shift) & (RADIX_SIZE - 1)]++;
+        codes_out[position] = codes[i];
+        values_out[position] = values[i];
+      }
+    });
+    codes.swap(codes_out);
+    values.swap(values_out);
+  }
+}
+
+// length of the common prefix of the codes at i and j, equal codes are told
+// apart by their index
+inline int common_prefix(const std::vector<uint64_t> &codes, int i, int j) {
+  if (j < 0 || j >= static_cast<int>(codes.size())) {
+    return -1;
+  }
+  if (codes[i] == codes[j]) {
+    return 64 + __builtin_clz(static_cast<uint32_t>(i ^ j));
+  }
+  return __builtin_clzll(codes[i] ^ codes[j]);
+}
+
+struct RadixNode {
+  int first;
+  int last;
+  int left;  // internal node index, or ~primitive for a single leaf
+  int right;
+};
+
+void build_radix_node(const std::vector<uint64_t> &codes, int i,
+                      RadixNode &node) {
+  const int d =
+      common_prefix(codes, i, i + 1) - common_prefix(codes, i, i - 1) >= 0
+          ? 1
+          : -1;
+
+  // find the other end of the range covered by the node
+  const int prefix_min = common_prefix(codes, i, i - d);
+  int length_max = 2;
+  while (common_prefix(codes, i, i + length_max * d) > prefix_min) {
+    length_max *= 2;
+  }
+  int length = 0;
+  for (int t = length_max / 2; t >= 1; t /= 2) {
+    if (common_prefix(codes, i, i + (length + t) * d) > prefix_min) {
+      length += t;
+    }
+  }
+  const int j = i + length * d;
+
+  // the split is where the common prefix of the range gets one bit longer
+  const int prefix_node = common_prefix(codes, i, j);
+  int split = 0;
+  int step = length;
+  do {
+    step = (step + 1) >> 1;
+    if (common_prefix(codes, i, i + (split + step) * d) > prefix_node) {
+      split += step;
+    }
+  } while (step > 1);
+  const int gamma = i + split * d + std::min(d, 0);
+
+  node.first = std::min(i, j);
+  node.last = std::max(i, j);
+  node.left = node.first == gamma ? ~gamma : gamma;
+  node.right = node.last == gamma + 1 ? ~(gamma + 1) : gamma + 1;
+}
+
+void build_lbvh(BuildData &data, const Bounds &centroid_bounds) {
+  ThreadPool &pool = *data.pool;
+  const int count = data.order.size();
+  const int bits_per_axis = count > MORTON_63_THRESHOLD ? 21 : 10;
+
+  std::vector<uint64_t> codes(count);
+  pool.parallel_for(0, count, CHUNK_SIZE, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      codes[i] = morton_code(data.centroids[i], centroid_bounds, bits_per_axis);
+    }
+  });
+  radix_sort(pool, codes, data.order, 3 * bits_per_axis);
+
+  std::vector<RadixNode> radix_nodes(std::max(1, count - 1));
+  if (count > 1) {
+    pool.parallel_for(0, count - 1, CHUNK_SIZE, [&](int first, int last) {
+      for (int i = first; i < last; ++i) {
+        build_radix_node(codes, i, radix_nodes[i]);
+      }
+    });
+  } else {
+    radix_nodes[0] = {0, 0, ~0, ~0};
+  }
+
+  // lay the radix tree out like the SAH tree, siblings next to each other,
+  // and collapse small ranges into leaves
+  struct Entry {
+    int node_index;
+    int radix_index; // internal node index, or ~primitive for a single leaf
+    int depth;
+  };
+  std::vector<Entry> stack;
+  stack.push_back({0, count > 1 ? 0 : ~0, 0});
+  int node_count = 1;
+  while (!stack.empty()) {
+    const Entry entry = stack.back();
+    stack.pop_back();
+    BVHNode &node = data.nodes[entry.node_index];
+
+    if (entry.radix_index < 0) {
+      node.left_first = ~entry.radix_index;
+      node.prim_count = 1;
+      continue;
+    }
+    const RadixNode &radix_node = radix_nodes[entry.radix_index];
+    const int range = radix_node.last - radix_node.first + 1;
+    if (range <= MAX_LEAF_SIZE || entry.depth >= parser::BVH_MAX_DEPTH) {
+      node.left_first = radix_node.first;
+      node.prim_count = range;
+      continue;
+    }
+    node.left_first = node_count;
+    node.prim_count = 0;
+    stack.push_back({node_count, radix_node.left, entry.depth + 1});
+    stack.push_back({node_count + 1, radix_node.right, entry.depth + 1});
+    node_count += 2;
+  }
+  data.node_count = node_count;
+
+  // children always follow their parent, so a reverse sweep refits the boxes
+  for (int n = node_count - 1; n >= 0; --n) {
+    BVHNode &node = data.nodes[n];
+    Bounds b = empty_bounds();
+    if (node.prim_count > 0) {
+      for (int i = node.left_first; i < node.left_first + node.prim_count;
+           ++i) {
+        grow(b, data.bounds[data.order[i]]);
+      }
+    } else {
+      const BVHNode &left = data.nodes[node.left_first];
+      const BVHNode &right = data.nodes[node.left_first + 1];
+      b = {left.box_min, left.box_max};
+      grow(b, right.box_min);
+      grow(b, right.box_max);
+    }
+    node.box_min = b.box_min;
+    node.box_max = b.box_max;
+  }
+}
+
+// pulls the grandchildren of the binary node up until BVH_WIDTH children are
+// collected, always opening the inner child with the largest surface area
+void collapse(const std::vector<BVHNode> &binary, int binary_index,
+              std::vector<parser::WideBVHNode,
+                          AlignedAllocator<parser::WideBVHNode, 64> > &wide,
+              int wide_index) {
+  int children[parser::BVH_WIDTH];
+  int child_count = 0;
+  if (binary[binary_index].prim_count > 0) {
+    children[child_count++] = binary_index;
+  } else {
+    children[child_count++] = binary[binary_index].left_first;
+    children[child_count++] = binary[binary_index].left_first + 1;
+  }
+
+  while (child_count < parser::BVH_WIDTH) {
+    int largest = -1;
+    float largest_area = -1.0f;
+    for (int c = 0; c < child_count; ++c) {
+      const BVHNode &child = binary[children[c]];
+      const float area = surface_area({child.box_min, child.box_max});
+      if (child.prim_count == 0 && area > largest_area) {
+        largest = c;
+        largest_area = area;
+      }
+    }
+    if (largest < 0) {
+      break;
+    }
+    const int opened = children[largest];
+    children[largest] = binary[opened].left_first;
+    children[child_count++] = binary[opened].left_first + 1;
+  }
+
+  const float inf = std::numeric_limits<float>::infinity();
+  for (int c = 0; c < parser::BVH_WIDTH; ++c) {
+    parser::WideBVHNode &node = wide[wide_index];
+    if (c >= child_count) {
+      // inverted boxes are missed by the traversal whatever the ray is
+      for (int k = 0; k < 6; k += 2) {
+        node.bounds[k][c] = inf;
+        node.bounds[k + 1][c] = -inf;
+      }
+      node.child[c] = 0;
+      node.prim_count[c] = 0;
+      continue;
+    }
+
+    const BVHNode &child = binary[children[c]];
+    node.bounds[0][c] = child.box_min.x;
+    node.bounds[1][c] = child.box_max.x;
+    node.bounds[2][c] = child.box_min.y;
+    node.bounds[3][c] = child.box_max.y;
+    node.bounds[4][c] = child.box_min.z;
+    node.bounds[5][c] = child.box_max.z;
+    if (child.prim_count > 0) {
+      node.child[c] = child.left_first;
+      node.prim_count[c] = child.prim_count;
+    } else {
+      const int child_index = wide.size();
+      node.child[c] = child_index;
+      node.prim_count[c] = 0;
+      wide.push_back(parser::WideBVHNode());
+      collapse(binary, children[c], wide, child_index);
+    }
+  }
+}
+
+} // namespace
+
+void parser::Scene::buildBVH(ThreadPool &pool, BVHBuilder builder) {
+  primitives.clear();
+  bvh_nodes.clear();
+  bvh_node_array = NULL;
+  bvh_node_count = 0;
+  bvh_mapping.reset();
+  triangle_soa = TriangleSoA();
+
+  for (size_t i = 0; i < spheres.size(); ++i) {
+    primitives.push_back({SPHERE, static_cast<int>(i), 0});
+  }
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    primitives.push_back({TRIANGLE, static_cast<int>(i), 0});
+  }
+  // spilled faces are only known by their count and boxes
+  const SpilledFaces *spilled = spilled_faces.get();
+  for (size_t i = 0; i < meshes.size(); ++i) {
+    const size_t face_count =
+        spilled ? spilled->face_count(i) : meshes[i].faces.size();
+    for (size_t j = 0; j < face_count; ++j) {
+      primitives.push_back(
+          {MESH_FACE, static_cast<int>(i), static_cast<int>(j)});
+    }
+  }
+  if (primitives.empty()) {
+    return;
+  }
+
+  const int count = primitives.size();
+  BuildData data;
+  data.pool = &pool;
+  data.bounds.resize(count);
+  data.centroids.resize(count);
+  data.order.resize(count);
+
+  pool.parallel_for(0, count, CHUNK_SIZE, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const Primitive &primitive = primitives[i];
+      Bounds b = empty_bounds();
+      if (primitive.type == SPHERE) {
+        const Sphere &sphere = spheres[primitive.object_id];
+        const Vec3f center = vertex_data[sphere.center_vertex_id - 1];
+        const Vec3f extent = {sphere.radius, sphere.radius, sphere.radius};
+        b = {subtract_vectors(center, extent), add_vectors(center, extent)};
+      } else if (primitive.type == MESH_FACE && spilled) {
+        const FaceBounds &face_bounds =
+            spilled->bounds(primitive.object_id, primitive.face_id);
+        b = {face_bounds.box_min, face_bounds.box_max};
+      } else {
+        const Face &face = primitive.type == TRIANGLE
+                               ? triangles[primitive.object_id].indices
+                               : meshes[primitive.object_id]
+                                     .faces[primitive.face_id];
+        grow(b, vertex_data[face.v0_id - 1]);
+        grow(b, vertex_data[face.v1_id - 1]);
+        grow(b, vertex_data[face.v2_id - 1]);
+      }
+      data.bounds[i] = b;
+      data.centroids[i] =
+          multiply_vector(add_vectors(b.box_min, b.box_max), 0.5f);
+      data.order[i] = i;
+    }
+  });
+  if (spilled_faces) {
+    spilled_faces->release_bounds();
+  }
+
+  data.nodes.resize(2 * count - 1);
+  data.node_count = 1;
+  if (builder == LBVH_BUILDER) {
+    std::vector<Bounds> chunk_centroid(
+        (count + CHUNK_SIZE - 1) / CHUNK_SIZE, empty_bounds());
+    pool.parallel_for(0, count, CHUNK_SIZE, [&](int first, int last) {
+      for (int i = first; i < last; ++i) {
+        grow(chunk_centroid[first / CHUNK_SIZE], data.centroids[i]);
+      }
+    });
+    Bounds centroid_bounds = empty_bounds();
+    for (size_t c = 0; c < chunk_centroid.size(); ++c) {
+      grow(centroid_bounds, chunk_centroid[c]);
+    }
+    build_lbvh(data, centroid_bounds);
+  } else {
+    TaskGroup group;
+    subdivide_parallel(data, group, 0, 0, count, 0);
+    pool.wait(group);
+  }
+  data.nodes.resize(data.node_count);
+  bvh_nodes.push_back(WideBVHNode());
+  collapse(data.nodes, 0, bvh_nodes, 0);
+
+  std::vector<Primitive> ordered(count);
+  pool.parallel_for(0, count, CHUNK_SIZE, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      ordered[i] = primitives[data.order[i]];
+    }
+  });
+  primitives.swap(ordered);
+  bvh_node_array = bvh_nodes.data();
+  bvh_node_count = bvh_nodes.size();
+}
+
+void parser::Scene::buildTriangleSoA(ThreadPool &pool) {
+  TriangleSoA &soa = triangle_soa;
+  const int count = primitives.size();
+  AlignedFloats *lanes[9] = {&soa.v0_x,    &soa.v0_y,    &soa.v0_z,
+                             &soa.edge1_x, &soa.edge1_y, &soa.edge1_z,
+                             &soa.edge2_x, &soa.edge2_y, &soa.edge2_z};
+  for (int k = 0; k < 9; ++k) {
+    lanes[k]->assign(count + TRIANGLE_SOA_PADDING, 0.0f);
+  }
+
+  pool.parallel_for(0, count, CHUNK_SIZE, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const Primitive &primitive = primitives[i];
+      if (primitive.type == SPHERE) {
+        continue;
+      }
+      const Face &face =
+          primitive.type == TRIANGLE
+              ? triangles[primitive.object_id].indices
+              : meshes[primitive.object_id].faces[primitive.face_id];
+      const Vec3f v0 = vertex_data[face.v0_id - 1];
+      const Vec3f edge1 = subtract_vectors(vertex_data[face.v1_id - 1], v0);
+      const Vec3f edge2 = subtract_vectors(vertex_data[face.v2_id - 1], v0);
+      soa.v0_x[i] = v0.x;
+      soa.v0_y[i] = v0.y;
+      soa.v0_z[i] = v0.z;
+      soa.edge1_x[i] = edge1.x;
+      soa.edge1_y[i] = edge1.y;
+      soa.edge1_z[i] = edge1.z;
+      soa.edge2_x[i] = edge2.x;
+      soa.edge2_y[i] = edge2.y;
+      soa.edge2_z[i] = edge2.z;
+    }
+  });
+}
+
+void parser::Scene::releaseTriangleData() {
+  triangle_soa = TriangleSoA();
+  for (size_t m = 0; m < meshes.size(); ++m) {
+    std::vector<Face>().swap(meshes[m].faces);
+  }
+  // only the sphere tests still read vertices
+  std::vector<Vec3f> centers;
+  centers.reserve(spheres.size());
+  for (size_t s = 0; s < spheres.size(); ++s) {
+    centers.push_back(vertex_data[spheres[s].center_vertex_id - 1]);
+    spheres[s].center_vertex_id = centers.size();
+  }
+  vertex_data.swap(centers);
+}
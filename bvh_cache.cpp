@@ -0,0 +1,243 @@
+#include "bvh_cache.h"
+#include "mapped_file.h"
+#include "scene_cache.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+
+const char MAGIC[8] = {'R', 'T', 'B', 'V', 'H', '\0', '\0', '\0'};
+const int CHUNK_SIZE = 1 << 13;
+
+// padded to 64 bytes so the nodes after it are as aligned as bvh_nodes
+struct BVHCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size; // sizeof(WideBVHNode), changes with BVH_WIDTH
+  uint64_t geometry_hash;
+  int32_t builder;
+  int32_t node_count;
+  int32_t primitive_count;
+  uint32_t reserved;
+  uint64_t size; // of the whole file
+  char padding[16];
+};
+
+// index of the first face of every mesh in the order buildBVH enumerates
+// primitives, with the total count at the end
+std::vector<int> mesh_offsets(const parser::Scene &scene) {
+  std::vector<int> offsets(scene.meshes.size() + 1);
+  offsets[0] = scene.spheres.size() + scene.triangles.size();
+  for (size_t m = 0; m < scene.meshes.size(); ++m) {
+    offsets[m + 1] = offsets[m] + scene.meshes[m].faces.size();
+  }
+  return offsets;
+}
+
+// a slot collapse left unused: inverted box, no child
+bool empty_slot(const parser::WideBVHNode &node, int c) {
+  const float inf = std::numeric_limits<float>::infinity();
+  for (int k = 0; k < 6; k += 2) {
+    if (node.bounds[k][c] != inf || node.bounds[k + 1][c] != -inf) {
+      return false;
+    }
+  }
+  return node.child[c] == 0 && node.prim_count[c] == 0;
+}
+
+} // namespace
+
+// collapse always numbers children after their parent, so the depth of
+// every node is known once the nodes before it are checked
+bool nodes_valid(const parser::WideBVHNode *nodes, int node_count,
+                 int primitive_count) {
+  std::vector<int> depth(node_count, 0);
+  for (int n = 0; n < node_count; ++n) {
+    for (int c = 0; c < parser::BVH_WIDTH; ++c) {
+      const int child = nodes[n].child[c];
+      const int prim_count = nodes[n].prim_count[c];
+      if (child < 0 || prim_count < 0) {
+        return false;
+      }
+      if (prim_count > 0) {
+        if (prim_count > primitive_count - child) {
+          return false;
+        }
+        continue;
+      }
+      if (empty_slot(nodes[n], c)) {
+        continue;
+      }
+      if (child <= n || child >= node_count ||
+          depth[n] + 1 >= parser::BVH_MAX_DEPTH) {
+        return false;
+      }
+      depth[child] = std::max(depth[child], depth[n] + 1);
+    }
+  }
+  return true;
+}
+
+uint64_t geometry_hash(const parser::Scene &scene) {
+  std::vector<uint64_t> parts;
+  parts.push_back(hash_bytes((const char *)scene.vertex_data.data(),
+                             scene.vertex_data.size() * sizeof(parser::Vec3f)));
+  std::vector<int> ids;
+  for (size_t s = 0; s < scene.spheres.size(); ++s) {
+    int radius;
+    std::memcpy(&radius, &scene.spheres[s].radius, sizeof(radius));
+    ids.push_back(scene.spheres[s].center_vertex_id);
+    ids.push_back(radius);
+  }
+  parts.push_back(hash_bytes((const char *)ids.data(), ids.size() * 4));
+  ids.clear();
+  for (size_t t = 0; t < scene.triangles.size(); ++t) {
+    const parser::Face &face = scene.triangles[t].indices;
+    ids.push_back(face.v0_id);
+    ids.push_back(face.v1_id);
+    ids.push_back(face.v2_id);
+  }
+  parts.push_back(hash_bytes((const char *)ids.data(), ids.size() * 4));
+  // the rest of a face is derived from the vertices and the ids
+  for (size_t m = 0; m < scene.meshes.size(); ++m) {
+    const std::vector<parser::Face> &faces = scene.meshes[m].faces;
+    ids.resize(faces.size() * 3);
+    for (size_t f = 0; f < faces.size(); ++f) {
+      ids[3 * f] = faces[f].v0_id;
+      ids[3 * f + 1] = faces[f].v1_id;
+      ids[3 * f + 2] = faces[f].v2_id;
+    }
+    parts.push_back(hash_bytes((const char *)ids.data(), ids.size() * 4));
+  }
+  return hash_bytes((const char *)parts.data(), parts.size() * 8);
+}
+
+std::string bvh_cache_path(const std::string &scene_file,
+                           parser::BVHBuilder builder) {
+  return scene_file +
+         (builder == parser::LBVH_BUILDER ? ".lbvh.bvh" : ".sah.bvh");
+}
+
+bool load_bvh_cache(const std::string &path, parser::BVHBuilder builder,
+                    ThreadPool &pool, parser::Scene &scene) {
+  if (access(path.c_str(), R_OK) != 0) {
+    return false;
+  }
+  std::shared_ptr<const MappedFile> file(new MappedFile(path));
+  BVHCacheHeader header;
+  if (file->size() < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, file->data(), sizeof(header));
+  const std::vector<int> offsets = mesh_offsets(scene);
+  const int primitive_count = offsets.back();
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != BVH_CACHE_VERSION ||
+      header.node_size != sizeof(parser::WideBVHNode) ||
+      header.builder != builder || header.node_count <= 0 ||
+      header.primitive_count != primitive_count ||
+      header.size != file->size() ||
+      header.size != sizeof(header) +
+                         (uint64_t)header.node_count * header.node_size +
+                         (uint64_t)primitive_count * sizeof(int32_t) ||
+      header.geometry_hash != geometry_hash(scene)) {
+    return false;
+  }
+
+  const parser::WideBVHNode *nodes =
+      (const parser::WideBVHNode *)(file->data() + sizeof(header));
+  const int32_t *order =
+      (const int32_t *)(file->data() + sizeof(header) +
+                        (size_t)header.node_count * header.node_size);
+  if (!nodes_valid(nodes, header.node_count, primitive_count)) {
+    return false;
+  }
+  std::vector<char> seen(primitive_count, 0);
+  for (int i = 0; i < primitive_count; ++i) {
+    if (order[i] < 0 || order[i] >= primitive_count || seen[order[i]]) {
+      return false;
+    }
+    seen[order[i]] = 1;
+  }
+
+  const int sphere_count = scene.spheres.size();
+  const int triangle_end = offsets[0];
+  scene.primitives.resize(primitive_count);
+  pool.parallel_for(0, primitive_count, CHUNK_SIZE, [&](int first, int last) {
+    for (int i = first; i < last; ++i) {
+      const int index = order[i];
+      parser::Primitive &primitive = scene.primitives[i];
+      if (index < sphere_count) {
+        primitive = {parser::SPHERE, index, 0};
+      } else if (index < triangle_end) {
+        primitive = {parser::TRIANGLE, index - sphere_count, 0};
+      } else {
+        const int mesh =
+            std::upper_bound(offsets.begin(), offsets.end(), index) -
+            offsets.begin() - 1;
+        primitive = {parser::MESH_FACE, mesh, index - offsets[mesh]};
+      }
+    }
+  });
+
+  scene.bvh_nodes.clear();
+  scene.bvh_node_array = nodes;
+  scene.bvh_node_count = header.node_count;
+  scene.bvh_mapping = file;
+  return true;
+}
+
+void save_bvh_cache(const std::string &path, parser::BVHBuilder builder,
+                    const parser::Scene &scene) {
+  const std::vector<int> offsets = mesh_offsets(scene);
+  const int sphere_count = scene.spheres.size();
+  std::vector<int32_t> order(scene.primitives.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    const parser::Primitive &primitive = scene.primitives[i];
+    if (primitive.type == parser::SPHERE) {
+      order[i] = primitive.object_id;
+    } else if (primitive.type == parser::TRIANGLE) {
+      order[i] = sphere_count + primitive.object_id;
+    } else {
+      order[i] = offsets[primitive.object_id] + primitive.face_id;
+    }
+  }
+
+  BVHCacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = BVH_CACHE_VERSION;
+  header.node_size = sizeof(parser::WideBVHNode);
+  header.geometry_hash = geometry_hash(scene);
+  header.builder = builder;
+  header.node_count = scene.bvh_node_count;
+  header.primitive_count = order.size();
+  const size_t node_bytes = (size_t)scene.bvh_node_count * header.node_size;
+  const size_t order_bytes = order.size() * sizeof(int32_t);
+  header.size = sizeof(header) + node_bytes + order_bytes;
+
+  char pid[32];
+  std::snprintf(pid, sizeof(pid), ".%d.tmp", (int)getpid());
+  const std::string temporary = path + pid;
+  std::FILE *file = std::fopen(temporary.c_str(), "wb");
+  if (file == NULL) {
+    throw std::runtime_error("Error: " + temporary +
+                             " cannot be opened for writing.");
+  }
+  bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  written = written && (node_bytes == 0 ||
+                        std::fwrite(scene.bvh_node_array, node_bytes, 1,
+                                    file) == 1);
+  written = written && (order_bytes == 0 ||
+                        std::fwrite(order.data(), order_bytes, 1, file) == 1);
+  if (std::fclose(file) != 0 || !written ||
+      std::rename(temporary.c_str(), path.c_str()) != 0) {
+    std::remove(temporary.c_str());
+    throw std::runtime_error("Error: " + path + " cannot be written.");
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "parser.h"
+#include <cstdint>
+#include <string>
+
+class ThreadPool;
+
+// A built hierarchy on disk: a header, the wide nodes and, for every
+// primitive in leaf order, its index in the order buildBVH enumerates them
+// (spheres, triangles, then the faces mesh by mesh). Nodes refer to each
+// other and to primitives by index only, so the file is mapped and the
+// traversal reads the nodes straight from the mapping. The header records a
+// hash of the geometry the tree was built for; materials, lights and
+// cameras can change without invalidating it.
+const uint32_t BVH_CACHE_VERSION = 1;
+
+// of everything the hierarchy depends on: vertices, spheres and the vertex
+// ids of triangles and faces
+uint64_t geometry_hash(const parser::Scene &scene);
+
+// whether a tree read from disk can be traversed: children and leaf ranges
+// inside the node and primitive arrays, never back up the tree and no
+// deeper than the traversal stack allows
+bool nodes_valid(const parser::WideBVHNode *nodes, int node_count,
+                 int primitive_count);
+
+// the cache of a scene file, next to it
+std::string bvh_cache_path(const std::string &scene_file,
+                           parser::BVHBuilder builder);
+
+// false when the cache is missing, damaged, built by another builder or for
+// other geometry; on success the scene keeps the mapping alive through
+// bvh_mapping, triangle_soa is left to the caller like after buildBVH
+bool load_bvh_cache(const std::string &path, parser::BVHBuilder builder,
+                    ThreadPool &pool, parser::Scene &scene);
+// written to a temporary file that is renamed over path
+void save_bvh_cache(const std::string &path, parser::BVHBuilder builder,
+                    const parser::Scene &scene);
+
+#endif // BVH_CACHE_H
@@ -0,0 +1,79 @@
+// Wide BVH traversal, intentionally without include guards: intersect.h
+// includes it once per instruction set, inside a namespace that provides
+// the node test (NodeRay, make_node_ray, test_children) and the leaf test
+// (LeafRay, make_leaf_ray, intersect_leaf, occluded_leaf) for that set.
+
+inline Hit intersect_wide(const Ray &r, const parser::Scene &s) {
+  Hit hit = {std::numeric_limits<float>::infinity(), -1, 0.0f, 0.0f};
+  if (s.bvh_node_count == 0 || !ray_finite(r)) {
+    return hit;
+  }
+
+  const NodeRay node_ray = make_node_ray(make_box_ray(r));
+  const LeafRay leaf_ray = make_leaf_ray(r);
+
+  // nodes are pushed together with their entry distance so that subtrees
+  // behind the closest hit found so far can be skipped when popped
+  TraversalEntry stack[BVH_STACK_SIZE];
+  int stack_size = 0;
+  stack[stack_size++] = {0, 0, 0.0f};
+
+  while (stack_size > 0) {
+    const TraversalEntry entry = stack[--stack_size];
+    // a box entered at hit.t may still hold a tie that comes first in
+    // scene order
+    if (entry.t > box_limit(hit.t)) {
+      continue;
+    }
+
+    if (entry.prim_count > 0) {
+      intersect_leaf(s, entry.child, entry.prim_count, leaf_ray, r, hit);
+      continue;
+    }
+
+    const parser::WideBVHNode &node = s.bvh_node_array[entry.child];
+    float t_entry[parser::BVH_WIDTH];
+    const int mask =
+        test_children(node, node_ray, box_limit(hit.t), t_entry);
+    push_children(node, mask, t_entry, stack, stack_size);
+  }
+  return hit;
+}
+
+// any hit traversal, stops at the first primitive hit before t_max and never
+// builds an Intersection
+inline bool occluded_wide(const Ray &r, const parser::Scene &s, float t_max) {
+  if (s.bvh_node_count == 0 || !(t_max > 0.0f) || !ray_finite(r)) {
+    return false;
+  }
+
+  const NodeRay node_ray = make_node_ray(make_box_ray(r));
+  const LeafRay leaf_ray = make_leaf_ray(r);
+
+  // the order of the children does not matter, so only the node is pushed
+  TraversalEntry stack[BVH_STACK_SIZE];
+  int stack_size = 0;
+  stack[stack_size++] = {0, 0, 0.0f};
+
+  while (stack_size > 0) {
+    const TraversalEntry entry = stack[--stack_size];
+
+    if (entry.prim_count > 0) {
+      if (occluded_leaf(s, entry.child, entry.prim_count, leaf_ray, r,
+                        t_max)) {
+        return true;
+      }
+      continue;
+    }
+
+    const parser::WideBVHNode &node = s.bvh_node_array[entry.child];
+    float t_entry[parser::BVH_WIDTH];
+    int mask = test_children(node, node_ray, box_limit(t_max), t_entry);
+    while (mask) {
+      const int c = __builtin_ctz(mask);
+      mask &= mask - 1;
+      stack[stack_size++] = {node.child[c], node.prim_count[c], t_entry[c]};
+    }
+  }
+  return false;
+}
@@ -0,0 +1,212 @@
+#include "compact_geometry.h"
+#include "thread_pool.h"
+
+namespace {
+
+const int BLOCK_GRAIN = 1024;
+const float QUANTIZATION_STEPS = 65535.0f;
+
+// sorted 1-based vertex ids the triangles of the block use
+void block_vertex_ids(const parser::Scene &scene, int first, int count,
+                     std::vector<int> &ids) {
+  ids.clear();
+  for (int i = first; i < first + count; ++i) {
+    const parser::Primitive &primitive = scene.primitives[i];
+    if (primitive.type == parser::SPHERE) {
+      continue;
+    }
+    const parser::Face &face =
+        primitive.type == parser::TRIANGLE
+            ? scene.triangles[primitive.object_id].indices
+            : scene.meshes[primitive.object_id].faces[primitive.face_id];
+    ids.push_back(face.v0_id);
+    ids.push_back(face.v1_id);
+    ids.push_back(face.v2_id);
+  }
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+}
+
+uint16_t quantize(float value, float origin, float extent) {
+  if (!(extent > 0.0f)) {
+    return 0;
+  }
+  const float q = (value - origin) / extent * QUANTIZATION_STEPS;
+  return (uint16_t)std::lround(std::min(std::max(q, 0.0f), QUANTIZATION_STEPS));
+}
+
+// grows a box of the node to hold a point, min and max per axis
+void grow(parser::WideBVHNode &node, int c, float x, float y, float z) {
+  const float point[3] = {x, y, z};
+  for (int axis = 0; axis < 3; ++axis) {
+    node.bounds[2 * axis][c] = std::min(node.bounds[2 * axis][c], point[axis]);
+    node.bounds[2 * axis + 1][c] =
+        std::max(node.bounds[2 * axis + 1][c], point[axis]);
+  }
+}
+
+// Decoded vertices are off by up to half a quantization step, so a leaf box
+// built from the original vertices can cut a decoded triangle and rays
+// through that part miss it. Every leaf box is grown to hold its decoded
+// triangles and every inner box to hold the boxes below it, children first
+// since collapse numbers them after their parent.
+void refit_bounds(const CompactGeometry &geometry, parser::Scene &scene) {
+  if (scene.bvh_node_count == 0) {
+    return;
+  }
+  if (scene.bvh_nodes.empty()) {
+    // the nodes of a BVH cache are a read only mapping
+    scene.bvh_nodes.assign(scene.bvh_node_array,
+                           scene.bvh_node_array + scene.bvh_node_count);
+    scene.bvh_node_array = scene.bvh_nodes.data();
+    scene.bvh_mapping.reset();
+  }
+
+  std::vector<float> buffer;
+  for (int n = scene.bvh_node_count - 1; n >= 0; --n) {
+    parser::WideBVHNode &node = scene.bvh_nodes[n];
+    for (int c = 0; c < parser::BVH_WIDTH; ++c) {
+      const int count = node.prim_count[c];
+      if (count == 0) {
+        // unused slots have child 0, the root is nobody's child
+        if (node.child[c] == 0) {
+          continue;
+        }
+        const parser::WideBVHNode &child = scene.bvh_nodes[node.child[c]];
+        for (int k = 0; k < parser::BVH_WIDTH; ++k) {
+          // unused slots have inverted boxes
+          if (child.bounds[0][k] > child.bounds[1][k]) {
+            continue;
+          }
+          grow(node, c, child.bounds[0][k], child.bounds[2][k],
+               child.bounds[4][k]);
+          grow(node, c, child.bounds[1][k], child.bounds[3][k],
+               child.bounds[5][k]);
+        }
+        continue;
+      }
+
+      const int first = node.child[c];
+      buffer.resize(9 * (size_t)count);
+      float *lanes[9];
+      for (int k = 0; k < 9; ++k) {
+        lanes[k] = &buffer[k * (size_t)count];
+      }
+      geometry.decode_leaf(first, count, lanes);
+      for (int i = 0; i < count; ++i) {
+        if (scene.primitives[first + i].type == parser::SPHERE) {
+          continue;
+        }
+        const float x = lanes[0][i], y = lanes[1][i], z = lanes[2][i];
+        grow(node, c, x, y, z);
+        grow(node, c, x + lanes[3][i], y + lanes[4][i], z + lanes[5][i]);
+        grow(node, c, x + lanes[6][i], y + lanes[7][i], z + lanes[8][i]);
+      }
+    }
+  }
+}
+
+} // namespace
+
+CompactGeometry::CompactGeometry(ThreadPool &pool,
+                                 const parser::Scene &scene) {
+  const int primitive_count = scene.primitives.size();
+  const int count =
+      (primitive_count + COMPACT_BLOCK_SIZE - 1) >> COMPACT_BLOCK_SHIFT;
+  blocks.resize(count);
+
+  // the size of every table first, they are laid out one after the other;
+  // a block of spheres only gets one vertex for its degenerate lanes
+  std::vector<int> table_size(count);
+  pool.parallel_for(0, count, BLOCK_GRAIN, [&](int begin, int end) {
+    std::vector<int> ids;
+    for (int b = begin; b < end; ++b) {
+      const int first = b << COMPACT_BLOCK_SHIFT;
+      block_vertex_ids(scene, first,
+                       std::min(COMPACT_BLOCK_SIZE, primitive_count - first),
+                       ids);
+      table_size[b] = std::max<int>(ids.size(), 1);
+    }
+  });
+  uint32_t offset = 0;
+  for (int b = 0; b < count; ++b) {
+    blocks[b].vertex_offset = offset;
+    offset += table_size[b];
+  }
+
+  positions.resize(3 * (size_t)offset);
+  corners.assign(3 * (size_t)primitive_count, 0);
+  normals.assign(primitive_count, 0);
+  pool.parallel_for(0, count, BLOCK_GRAIN, [&](int begin, int end) {
+    std::vector<int> ids;
+    for (int b = begin; b < end; ++b) {
+      const int first = b << COMPACT_BLOCK_SHIFT;
+      const int last = std::min(first + COMPACT_BLOCK_SIZE, primitive_count);
+      block_vertex_ids(scene, first, last - first, ids);
+      Block &block = blocks[b];
+      if (ids.empty()) {
+        for (int axis = 0; axis < 3; ++axis) {
+          block.origin[axis] = 0.0f;
+          block.scale[axis] = 0.0f;
+        }
+        continue;
+      }
+
+      parser::Vec3f box_min = scene.vertex_data[ids[0] - 1];
+      parser::Vec3f box_max = box_min;
+      for (size_t v = 1; v < ids.size(); ++v) {
+        const parser::Vec3f &p = scene.vertex_data[ids[v] - 1];
+        box_min = {std::min(box_min.x, p.x), std::min(box_min.y, p.y),
+                   std::min(box_min.z, p.z)};
+        box_max = {std::max(box_max.x, p.x), std::max(box_max.y, p.y),
+                   std::max(box_max.z, p.z)};
+      }
+      const float origin[3] = {box_min.x, box_min.y, box_min.z};
+      const float extent[3] = {box_max.x - box_min.x, box_max.y - box_min.y,
+                               box_max.z - box_min.z};
+      for (int axis = 0; axis < 3; ++axis) {
+        block.origin[axis] = origin[axis];
+        block.scale[axis] = extent[axis] / QUANTIZATION_STEPS;
+      }
+      uint16_t *table = &positions[3 * (size_t)block.vertex_offset];
+      for (size_t v = 0; v < ids.size(); ++v) {
+        const parser::Vec3f &p = scene.vertex_data[ids[v] - 1];
+        table[3 * v] = quantize(p.x, origin[0], extent[0]);
+        table[3 * v + 1] = quantize(p.y, origin[1], extent[1]);
+        table[3 * v + 2] = quantize(p.z, origin[2], extent[2]);
+      }
+
+      for (int i = first; i < last; ++i) {
+        const parser::Primitive &primitive = scene.primitives[i];
+        if (primitive.type == parser::SPHERE) {
+          continue;
+        }
+        const bool triangle = primitive.type == parser::TRIANGLE;
+        const parser::Face &face =
+            triangle
+                ? scene.triangles[primitive.object_id].indices
+                : scene.meshes[primitive.object_id].faces[primitive.face_id];
+        const int face_ids[3] = {face.v0_id, face.v1_id, face.v2_id};
+        for (int k = 0; k < 3; ++k) {
+          corners[3 * (size_t)i + k] =
+              std::lower_bound(ids.begin(), ids.end(), face_ids[k]) -
+              ids.begin();
+        }
+        if (!triangle) {
+          normals[i] = encode_octahedral(face.normal);
+        }
+      }
+    }
+  });
+}
+
+size_t CompactGeometry::bytes() const {
+  return blocks.size() * sizeof(Block) + positions.size() * sizeof(uint16_t) +
+         corners.size() * sizeof(uint8_t) + normals.size() * sizeof(uint32_t);
+}
+
+void compact_geometry(ThreadPool &pool, parser::Scene &scene) {
+  scene.compact_geometry.reset(new CompactGeometry(pool, scene));
+  refit_bounds(*scene.compact_geometry, scene);
+  scene.releaseTriangleData();
+}
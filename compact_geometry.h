@@ -0,0 +1,113 @@
+#ifndef COMPACT_GEOMETRY_H
+#define COMPACT_GEOMETRY_H
+
+#include "parser.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+// unit vector folded onto an octahedron and stored as two 16-bit snorms,
+// x in the low half
+inline uint32_t encode_octahedral(const parser::Vec3f &n) {
+  const float sum = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+  if (sum == 0.0f) {
+    return 0;
+  }
+  float x = n.x / sum;
+  float y = n.y / sum;
+  if (n.z < 0.0f) {
+    const float folded_x = (1.0f - std::abs(y)) * (x < 0.0f ? -1.0f : 1.0f);
+    y = (1.0f - std::abs(x)) * (y < 0.0f ? -1.0f : 1.0f);
+    x = folded_x;
+  }
+  const int16_t qx = (int16_t)std::lround(x * 32767.0f);
+  const int16_t qy = (int16_t)std::lround(y * 32767.0f);
+  return (uint16_t)qx | (uint32_t)(uint16_t)qy << 16;
+}
+
+inline parser::Vec3f decode_octahedral(uint32_t code) {
+  const float x = (int16_t)(code & 0xffff) / 32767.0f;
+  const float y = (int16_t)(code >> 16) / 32767.0f;
+  const float z = 1.0f - std::abs(x) - std::abs(y);
+  parser::Vec3f n = {x, y, z};
+  if (z < 0.0f) {
+    n.x = (1.0f - std::abs(y)) * (x < 0.0f ? -1.0f : 1.0f);
+    n.y = (1.0f - std::abs(x)) * (y < 0.0f ? -1.0f : 1.0f);
+  }
+  const float length = std::sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+  if (length > 0.0f) {
+    n = {n.x / length, n.y / length, n.z / length};
+  }
+  return n;
+}
+
+// primitives quantized together, a power of two so the block of a
+// primitive is a shift away
+const int COMPACT_BLOCK_SHIFT = 4;
+const int COMPACT_BLOCK_SIZE = 1 << COMPACT_BLOCK_SHIFT;
+
+// Compressed triangles. Primitives are grouped into blocks of
+// COMPACT_BLOCK_SIZE in BVH order, so a block covers one or a few
+// neighbouring leaves. Every block has a table of the vertices its triangles
+// use, quantized to 16 bits per axis inside the bounding box of the block,
+// and every primitive three one byte indices into that table and an
+// octahedral normal. Leaves are decoded when they are tested.
+class CompactGeometry {
+public:
+  CompactGeometry(ThreadPool &pool, const parser::Scene &scene);
+
+  // primitives [first, first + count) as triangle lanes, lane i holding
+  // primitive first + i; lanes past count are left as they were
+  void decode_leaf(int first, int count, float *const lanes[9]) const {
+    const uint8_t *corner = &corners[3 * (size_t)first];
+    for (int i = 0; i < count;) {
+      const int block_index = (first + i) >> COMPACT_BLOCK_SHIFT;
+      const Block &block = blocks[block_index];
+      const uint16_t *table = &positions[3 * (size_t)block.vertex_offset];
+      const int end = std::min(
+          count, ((block_index + 1) << COMPACT_BLOCK_SHIFT) - first);
+      for (; i < end; ++i, corner += 3) {
+        float v[3][3];
+        for (int k = 0; k < 3; ++k) {
+          const uint16_t *q = table + 3 * corner[k];
+          v[k][0] = block.origin[0] + q[0] * block.scale[0];
+          v[k][1] = block.origin[1] + q[1] * block.scale[1];
+          v[k][2] = block.origin[2] + q[2] * block.scale[2];
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+          lanes[axis][i] = v[0][axis];
+          lanes[3 + axis][i] = v[1][axis] - v[0][axis];
+          lanes[6 + axis][i] = v[2][axis] - v[0][axis];
+        }
+      }
+    }
+  }
+
+  uint32_t normal(int primitive) const { return normals[primitive]; }
+
+  int block_count() const { return blocks.size(); }
+  size_t bytes() const;
+
+private:
+  struct Block {
+    float origin[3]; // minimum of the box
+    float scale[3];  // extent of the box over 65535
+    uint32_t vertex_offset;
+  };
+
+  std::vector<Block> blocks;
+  std::vector<uint16_t> positions; // x y z of every table vertex
+  std::vector<uint8_t> corners;    // 3 table indices per primitive
+  std::vector<uint32_t> normals;   // octahedral, mesh faces only
+};
+
+// replaces the triangle data of the scene by a CompactGeometry and grows the
+// BVH boxes to the decoded triangles, after the BVH is built and any cache
+// written
+void compact_geometry(ThreadPool &pool, parser::Scene &scene);
+
+#endif // COMPACT_GEOMETRY_H
@@ -0,0 +1,27 @@
+#ifndef CPU_H
+#define CPU_H
+
+// instruction sets the intersection and shading kernels are compiled for,
+// the Makefile builds for the x86-64 baseline and every wider set is only
+// entered after the CPU and the OS are checked to support it
+enum SimdPath { SIMD_SSE42, SIMD_AVX2, SIMD_AVX512 };
+
+struct CpuFeatures {
+  bool sse42;
+  bool avx2; // includes FMA
+  bool avx512;
+};
+
+CpuFeatures detect_cpu_features();
+
+const char *simd_path_name(SimdPath path);
+
+// the widest path worth using on this CPU, RAYTRACER_SIMD=sse4.2|avx2|avx512
+// forces one for benchmarking
+SimdPath select_simd_path(const CpuFeatures &features, bool &forced);
+
+// cores the process may actually run on: hardware_concurrency limited by
+// the affinity mask and by a cgroup (v2 or v1) CPU quota, at least 1
+int available_cpu_count();
+
+#endif // CPU_H
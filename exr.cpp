@@ -0,0 +1,142 @@
+#include "exr.h"
+#include <cstring>
+#include <string>
+
+namespace {
+
+const int EXR_HALF = 1;
+
+void put_u32(std::vector<unsigned char> &out, uint32_t value) {
+  for (int b = 0; b < 4; ++b) {
+    out.push_back(value >> (8 * b));
+  }
+}
+
+void put_u64(std::vector<unsigned char> &out, uint64_t value) {
+  for (int b = 0; b < 8; ++b) {
+    out.push_back(value >> (8 * b));
+  }
+}
+
+void put_float(std::vector<unsigned char> &out, float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, 4);
+  put_u32(out, bits);
+}
+
+void put_string(std::vector<unsigned char> &out, const char *text) {
+  out.insert(out.end(), text, text + std::strlen(text) + 1);
+}
+
+// header attribute: name, type name, size, value
+void put_attribute(std::vector<unsigned char> &out, const char *name,
+                   const char *type, const std::vector<unsigned char> &value) {
+  put_string(out, name);
+  put_string(out, type);
+  put_u32(out, value.size());
+  out.insert(out.end(), value.begin(), value.end());
+}
+
+} // namespace
+
+uint16_t float_to_half(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, 4);
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const int raw_exponent = (bits >> 23) & 0xff;
+  uint32_t mantissa = bits & 0x7fffff;
+  if (raw_exponent == 0xff) {
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  const int exponent = raw_exponent - 127 + 15;
+  if (exponent >= 31) {
+    return sign | 0x7c00;
+  }
+  if (exponent <= 0) {
+    // subnormal half, the implicit bit becomes part of the mantissa
+    if (exponent < -10) {
+      return sign;
+    }
+    mantissa |= 0x800000;
+    const int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t remainder = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1))) {
+      ++half;
+    }
+    return sign | half;
+  }
+  // round to nearest even, a carry may correctly bump the exponent
+  uint32_t half = (exponent << 10) | (mantissa >> 13);
+  const uint32_t remainder = mantissa & 0x1fff;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+    ++half;
+  }
+  return sign | half;
+}
+
+void encode_exr(const float *pixels, int width, int height,
+                std::vector<unsigned char> &exr) {
+  exr.clear();
+  put_u32(exr, 20000630); // magic number
+  put_u32(exr, 2);        // version 2, single part scanline
+
+  // channels are stored in alphabetical order
+  const char *channel_names[3] = {"B", "G", "R"};
+  const int channel_offsets[3] = {2, 1, 0};
+  std::vector<unsigned char> value;
+  for (int c = 0; c < 3; ++c) {
+    put_string(value, channel_names[c]);
+    put_u32(value, EXR_HALF);
+    put_u32(value, 0); // pLinear and reserved bytes
+    put_u32(value, 1); // x sampling
+    put_u32(value, 1); // y sampling
+  }
+  value.push_back(0);
+  put_attribute(exr, "channels", "chlist", value);
+
+  put_attribute(exr, "compression", "compression",
+                std::vector<unsigned char>(1, 0));
+
+  value.clear();
+  put_u32(value, 0);
+  put_u32(value, 0);
+  put_u32(value, width - 1);
+  put_u32(value, height - 1);
+  put_attribute(exr, "dataWindow", "box2i", value);
+  put_attribute(exr, "displayWindow", "box2i", value);
+
+  put_attribute(exr, "lineOrder", "lineOrder",
+                std::vector<unsigned char>(1, 0));
+
+  value.clear();
+  put_float(value, 1.0f);
+  put_attribute(exr, "pixelAspectRatio", "float", value);
+  put_attribute(exr, "screenWindowWidth", "float", value);
+
+  value.clear();
+  put_float(value, 0.0f);
+  put_float(value, 0.0f);
+  put_attribute(exr, "screenWindowCenter", "v2f", value);
+  exr.push_back(0); // end of header
+
+  // one line per block: y, size, then the line of each channel in turn
+  const uint32_t line_size = width * 3 * 2;
+  const uint64_t table_end = exr.size() + (uint64_t)height * 8;
+  for (int y = 0; y < height; ++y) {
+    put_u64(exr, table_end + (uint64_t)y * (8 + line_size));
+  }
+  for (int y = 0; y < height; ++y) {
+    put_u32(exr, y);
+    put_u32(exr, line_size);
+    const float *row = pixels + (size_t)y * width * 3;
+    for (int c = 0; c < 3; ++c) {
+      for (int x = 0; x < width; ++x) {
+        const uint16_t half = float_to_half(row[x * 3 + channel_offsets[c]]);
+        exr.push_back(half & 0xff);
+        exr.push_back(half >> 8);
+      }
+    }
+  }
+}
@@ -0,0 +1,15 @@
+#ifndef EXR_H
+#define EXR_H
+
+#include <cstdint>
+#include <vector>
+
+// nearest half precision value, overflow goes to infinity
+uint16_t float_to_half(float value);
+
+// Encodes linear float RGB as an uncompressed scanline OpenEXR file with
+// half precision R, G and B channels.
+void encode_exr(const float *pixels, int width, int height,
+                std::vector<unsigned char> &exr);
+
+#endif // EXR_H
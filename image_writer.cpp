@@ -0,0 +1,123 @@
+#include "image_writer.h"
+#include "exr.h"
+#include "png.h"
+#include "ppm.h"
+#include "quantize.h"
+#include <algorithm>
+#include <cctype>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+void write_file(const std::string &filename,
+                const std::vector<unsigned char> &bytes, bool sync) {
+  const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("Error: " + filename +
+                             " cannot be opened for writing.");
+  }
+  size_t written = 0;
+  while (written < bytes.size()) {
+    const ssize_t n = ::write(fd, &bytes[written], bytes.size() - written);
+    if (n < 0) {
+      close(fd);
+      throw std::runtime_error("Error: " + filename + " cannot be written.");
+    }
+    written += n;
+  }
+  if (sync && fsync(fd) != 0) {
+    close(fd);
+    throw std::runtime_error("Error: " + filename +
+                             " cannot be synced to disk.");
+  }
+  close(fd);
+}
+
+void quantize_frame(const ImageWriterOptions &options, const float *radiance,
+                    int width, int height, std::vector<unsigned char> &pixels) {
+  pixels.resize((size_t)width * height * 3);
+  quantize(options.simd, radiance, pixels.data(), pixels.size());
+}
+
+class PpmWriter : public ImageWriter {
+public:
+  explicit PpmWriter(const ImageWriterOptions &options) : options(options) {}
+
+  void write(const std::string &filename, const float *radiance, int width,
+             int height) {
+    std::vector<unsigned char> pixels;
+    quantize_frame(options, radiance, width, height, pixels);
+    if (options.ascii_ppm) {
+      write_ppm(filename.c_str(), pixels.data(), width, height, options.sync);
+    } else {
+      write_ppm_binary(filename.c_str(), pixels.data(), width, height,
+                       options.sync);
+    }
+  }
+
+private:
+  ImageWriterOptions options;
+};
+
+class PngWriter : public ImageWriter {
+public:
+  explicit PngWriter(const ImageWriterOptions &options) : options(options) {}
+
+  void write(const std::string &filename, const float *radiance, int width,
+             int height) {
+    std::vector<unsigned char> pixels, png;
+    quantize_frame(options, radiance, width, height, pixels);
+    encode_png(pixels.data(), width, height, options.pool, png);
+    write_file(filename, png, options.sync);
+  }
+
+private:
+  ImageWriterOptions options;
+};
+
+// the unclamped radiance with 255 mapped to 1.0, the usual white of a
+// linear EXR, for compositing downstream
+class ExrWriter : public ImageWriter {
+public:
+  explicit ExrWriter(const ImageWriterOptions &options) : options(options) {}
+
+  void write(const std::string &filename, const float *radiance, int width,
+             int height) {
+    std::vector<float> linear((size_t)width * height * 3);
+    for (size_t i = 0; i < linear.size(); ++i) {
+      linear[i] = radiance[i] / 255.0f;
+    }
+    std::vector<unsigned char> exr;
+    encode_exr(linear.data(), width, height, exr);
+    write_file(filename, exr, options.sync);
+  }
+
+private:
+  ImageWriterOptions options;
+};
+
+bool has_extension(const std::string &filename, const std::string &extension) {
+  if (filename.size() < extension.size()) {
+    return false;
+  }
+  std::string tail = filename.substr(filename.size() - extension.size());
+  std::transform(tail.begin(), tail.end(), tail.begin(), ::tolower);
+  return tail == extension;
+}
+
+} // namespace
+
+std::unique_ptr<ImageWriter>
+create_image_writer(const std::string &filename,
+                    const ImageWriterOptions &options) {
+  if (has_extension(filename, ".png")) {
+    return std::unique_ptr<ImageWriter>(new PngWriter(options));
+  }
+  if (has_extension(filename, ".exr")) {
+    return std::unique_ptr<ImageWriter>(new ExrWriter(options));
+  }
+  return std::unique_ptr<ImageWriter>(new PpmWriter(options));
+}
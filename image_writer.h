@@ -0,0 +1,33 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "cpu.h"
+#include <memory>
+#include <string>
+
+class ThreadPool;
+
+struct ImageWriterOptions {
+  bool ascii_ppm;   // P3 instead of P6
+  bool sync;        // fsync every file before it counts as written
+  ThreadPool *pool; // compresses PNG strips, may be NULL
+  SimdPath simd;    // quantizes the radiance of 8-bit formats
+};
+
+// One output format. Frames are float RGB radiance on the 0-255 scale, rows
+// top to bottom; 8-bit formats clamp and quantize it, float formats store it
+// as is.
+class ImageWriter {
+public:
+  virtual ~ImageWriter() {}
+  virtual void write(const std::string &filename, const float *radiance,
+                     int width, int height) = 0;
+};
+
+// the writer for the extension of filename: .png, .exr, anything else is
+// written as a PPM
+std::unique_ptr<ImageWriter>
+create_image_writer(const std::string &filename,
+                    const ImageWriterOptions &options);
+
+#endif // IMAGE_WRITER_H
@@ -2,9 +2,13 @@
 #define INTERSECT_H
 
 #include "Ray.h"
+#include "compact_geometry.h"
+#include "paged_geometry.h"
 #include "parser.h"
 #include "utils.h"
+#include <algorithm>
 #include <complex>
+#include <immintrin.h>
 #include <limits>
 #include <vector>
 
@@ -16,6 +20,14 @@ struct Intersection {
   bool is_null = true;
 };
 
+// what the traversal keeps for the closest candidate, the point, normal and
+// material are only reconstructed for the final hit
+struct Hit {
+  float t;
+  int primitive; // index into Scene::primitives, -1 if nothing was hit
+  float u, v;    // barycentric coordinates of triangle hits
+};
+
 inline float intersect_sphere(const parser::Vec3f &vertex, float radius,
                               const Ray &r) {
   const parser::Vec3f origin = r.get_origin();
@@ -50,10 +62,9 @@ inline float intersect_sphere(const parser::Vec3f &vertex, float radius,
 }
 
 inline float intersect_triangle(const parser::Vec3f &vertex1,
-                                const parser::Vec3f &vertex2,
-                                const parser::Vec3f &vertex3,
-                                const parser::Vec3f edge1,
-                                const parser::Vec3f edge2, const Ray &r) {
+                                const parser::Vec3f &edge1,
+                                const parser::Vec3f &edge2, const Ray &r,
+                                float &u, float &v) {
   const parser::Vec3f h = cross_product(r.get_direction(), edge2);
   float a = dot_product(edge1, h);
 
@@ -63,13 +74,13 @@ inline float intersect_triangle(const parser::Vec3f &vertex1,
 
   const float f = 1.0f / a;
   parser::Vec3f s = subtract_vectors(r.get_origin(), vertex1);
-  const float u = f * dot_product(s, h);
+  u = f * dot_product(s, h);
 
   if (u < 0.0f || u > 1.0f)
     return -1;
 
   parser::Vec3f q = cross_product(s, edge1);
-  const float v = f * dot_product(r.get_direction(), q);
+  v = f * dot_product(r.get_direction(), q);
 
   if (v < 0.0f || u + v > 1.0f)
     return -1;
@@ -81,65 +92,733 @@ inline float intersect_triangle(const parser::Vec3f &vertex1,
   return -1;
 }
 
-inline Intersection intersect_objects(const Ray &r, const parser::Scene &s) {
+// the lane arrays the triangle kernels read
+struct TriangleLanes {
+  const float *v0_x, *v0_y, *v0_z;
+  const float *edge1_x, *edge1_y, *edge1_z;
+  const float *edge2_x, *edge2_y, *edge2_z;
+};
+
+// the lanes a leaf reads, lane i holding primitive offset + i: triangle_soa,
+// out of core the chunk of the leaf, pinned by the thread until it acquires
+// another one, or the leaf decoded into lanes of the thread when the
+// geometry is compact
+struct LeafLanes {
+  TriangleLanes lanes;
+  int offset;
+};
+
+// lanes of a decoded leaf that need no allocation, BVH leaves rarely hold
+// more than 16 primitives
+const int COMPACT_FIXED_LANES = 64;
+
+inline LeafLanes leaf_lanes(const parser::Scene &s, int first, int count) {
+  LeafLanes leaf;
+  if (s.compact_geometry) {
+    // the lanes stay valid until the thread decodes its next leaf, leaves
+    // too large for the fixed lanes grow a buffer of their own
+    const int fixed = COMPACT_FIXED_LANES - parser::TRIANGLE_SOA_PADDING;
+    static thread_local float small[9][COMPACT_FIXED_LANES];
+    static thread_local parser::AlignedFloats large;
+    float *lanes[9];
+    if (count <= fixed) {
+      for (int k = 0; k < 9; ++k) {
+        lanes[k] = small[k];
+      }
+    } else {
+      const size_t needed = count + parser::TRIANGLE_SOA_PADDING;
+      if (large.size() < 9 * needed) {
+        large.assign(9 * needed, 0.0f);
+      }
+      for (int k = 0; k < 9; ++k) {
+        lanes[k] = &large[k * (large.size() / 9)];
+      }
+    }
+    s.compact_geometry->decode_leaf(first, count, lanes);
+    leaf.lanes = {lanes[0], lanes[1], lanes[2], lanes[3], lanes[4],
+                  lanes[5], lanes[6], lanes[7], lanes[8]};
+    leaf.offset = first;
+    return leaf;
+  }
+  if (!s.paged_geometry) {
+    const parser::TriangleSoA &soa = s.triangle_soa;
+    leaf.lanes = {soa.v0_x.data(),    soa.v0_y.data(),    soa.v0_z.data(),
+                  soa.edge1_x.data(), soa.edge1_y.data(), soa.edge1_z.data(),
+                  soa.edge2_x.data(), soa.edge2_y.data(), soa.edge2_z.data()};
+    leaf.offset = 0;
+    return leaf;
+  }
+  const GeometryChunk &chunk =
+      *s.paged_geometry->acquire(s.paged_geometry->chunk_of(first));
+  leaf.lanes = {chunk.lane(LANE_V0_X),    chunk.lane(LANE_V0_Y),
+                chunk.lane(LANE_V0_Z),    chunk.lane(LANE_EDGE1_X),
+                chunk.lane(LANE_EDGE1_Y), chunk.lane(LANE_EDGE1_Z),
+                chunk.lane(LANE_EDGE2_X), chunk.lane(LANE_EDGE2_Y),
+                chunk.lane(LANE_EDGE2_Z)};
+  leaf.offset = chunk.first;
+  return leaf;
+}
+
+inline float intersect_triangle(const TriangleLanes &triangles, int i,
+                                const Ray &r, float &u, float &v) {
+  return intersect_triangle(
+      {triangles.v0_x[i], triangles.v0_y[i], triangles.v0_z[i]},
+      {triangles.edge1_x[i], triangles.edge1_y[i], triangles.edge1_z[i]},
+      {triangles.edge2_x[i], triangles.edge2_y[i], triangles.edge2_z[i]}, r,
+      u, v);
+}
+
+// distance to the i-th primitive along the ray, or -1 if it is missed
+inline float hit_distance(int i, const LeafLanes &leaf, const Ray &r,
+                          const parser::Scene &s, float &u, float &v) {
+  const parser::Primitive &primitive = s.primitives[i];
+  if (primitive.type == parser::SPHERE) {
+    const parser::Sphere &sphere = s.spheres[primitive.object_id];
+    return intersect_sphere(s.vertex_data[sphere.center_vertex_id - 1],
+                            sphere.radius, r);
+  }
+  return intersect_triangle(leaf.lanes, i - leaf.offset, r, u, v);
+}
 
-  float t = -1;
-  Intersection min_intersection;
-  min_intersection.t = std::numeric_limits<float>::infinity();
-  for (const parser::Sphere &sphere : s.spheres) {
+inline Intersection make_intersection(const Hit &hit, const Ray &r,
+                                      const parser::Scene &s) {
+  Intersection intersection;
+  intersection.t = hit.t;
+  if (hit.primitive < 0) {
+    return intersection;
+  }
+
+  const parser::Primitive &primitive = s.primitives[hit.primitive];
+  intersection.point = r.get_point(hit.t);
+  switch (primitive.type) {
+  case parser::SPHERE: {
+    const parser::Sphere &sphere = s.spheres[primitive.object_id];
     parser::Vec3f center = s.vertex_data[sphere.center_vertex_id - 1];
-    t = intersect_sphere(center, sphere.radius, r);
-    if (t > 0.0f && t < min_intersection.t) {
-      Intersection intersection;
-      intersection.point = r.get_point(t);
-      parser::Vec3f normal = subtract_vectors(intersection.point, center);
-      intersection.normal = normalize(normal);
-      intersection.material = &s.materials[sphere.material_id - 1];
-      intersection.t = t;
-      min_intersection = intersection;
-      min_intersection.is_null = false;
+    intersection.normal =
+        normalize(subtract_vectors(intersection.point, center));
+    intersection.material = &s.materials[sphere.material_id - 1];
+    break;
+  }
+  case parser::TRIANGLE: {
+    const parser::Triangle &triangle = s.triangles[primitive.object_id];
+    intersection.normal = triangle.normal;
+    intersection.material = &s.materials[triangle.material_id - 1];
+    break;
+  }
+  case parser::MESH_FACE: {
+    const parser::Mesh &mesh = s.meshes[primitive.object_id];
+    if (s.compact_geometry) {
+      intersection.normal =
+          decode_octahedral(s.compact_geometry->normal(hit.primitive));
+    } else if (s.paged_geometry) {
+      PagedGeometry &paged = *s.paged_geometry;
+      const GeometryChunk *chunk =
+          paged.acquire(paged.chunk_of(hit.primitive));
+      const int i = hit.primitive - chunk->first;
+      intersection.normal = {chunk->lane(LANE_NORMAL_X)[i],
+                             chunk->lane(LANE_NORMAL_Y)[i],
+                             chunk->lane(LANE_NORMAL_Z)[i]};
+    } else {
+      intersection.normal = mesh.faces[primitive.face_id].normal;
     }
+    intersection.material = &s.materials[mesh.material_id - 1];
+    break;
+  }
+  }
+  intersection.is_null = false;
+  return intersection;
+}
+
+// the order the scene lists primitives in, spheres, triangles, then the
+// faces mesh by mesh; of two hits at the same distance the first one in
+// this order is kept, so the image does not depend on the tree
+inline bool scene_order_before(const parser::Primitive &a,
+                               const parser::Primitive &b) {
+  if (a.type != b.type) {
+    return a.type < b.type;
+  }
+  if (a.object_id != b.object_id) {
+    return a.object_id < b.object_id;
   }
+  return a.face_id < b.face_id;
+}
 
-  for (const parser::Triangle &triangle : s.triangles) {
-    const parser::Vec3f vertex1 = s.vertex_data[triangle.indices.v0_id - 1];
-    const parser::Vec3f vertex2 = s.vertex_data[triangle.indices.v1_id - 1];
-    const parser::Vec3f vertex3 = s.vertex_data[triangle.indices.v2_id - 1];
+// whether a hit of primitive i at t replaces the current closest hit
+inline bool closer_hit(const parser::Scene &s, float t, int i,
+                       const Hit &hit) {
+  if (t != hit.t) {
+    return t < hit.t;
+  }
+  return hit.primitive < 0 ||
+         scene_order_before(s.primitives[i], s.primitives[hit.primitive]);
+}
 
-    float t = intersect_triangle(vertex1, vertex2, vertex3, triangle.edge1, triangle.edge2, r);
+// the kernels keep t < t_max, ties with the current hit have to pass them
+// to be settled by closer_hit
+inline float tie_limit(float t) {
+  return std::nextafter(t, std::numeric_limits<float>::infinity());
+}
+
+// Box distances round differently from triangle distances: a ray through
+// an edge can leave one slab a few ulps before entering the next, and a box
+// holding a tie can seem to be entered a few ulps after it. Exits and the
+// limit boxes are tested against are stretched by this factor, well above
+// the rounding error of the slab tests, so such boxes are still visited.
+const float BOX_SLACK = 1.0f + 1.0f / (1 << 20);
 
-    if (t > 0.0f && t < min_intersection.t) {
-      Intersection intersection;
-      intersection.point = r.get_point(t);
+inline float box_limit(float t) { return t * BOX_SLACK; }
 
-      intersection.normal = triangle.normal;
-      intersection.material = &s.materials[triangle.material_id - 1];
-      intersection.t = t;
-      min_intersection = intersection;
-      min_intersection.is_null = false;
+// takes the closest of the kernel lanes in mask, lane l being primitive
+// base + l
+inline void take_closest_lane(const parser::Scene &s, int base, int mask,
+                              const float *t, const float *u, const float *v,
+                              Hit &hit) {
+  for (; mask; mask &= mask - 1) {
+    const int lane = __builtin_ctz(mask);
+    if (closer_hit(s, t[lane], base + lane, hit)) {
+      hit.t = t[lane];
+      hit.primitive = base + lane;
+      hit.u = u[lane];
+      hit.v = v[lane];
     }
   }
+}
 
-  for (const parser::Mesh &mesh : s.meshes) {
-    for (const parser::Face &face : mesh.faces) {
-      const parser::Vec3f vertex1 = s.vertex_data[face.v0_id - 1];
-      const parser::Vec3f vertex2 = s.vertex_data[face.v1_id - 1];
-      const parser::Vec3f vertex3 = s.vertex_data[face.v2_id - 1];
+struct TraversalEntry {
+  int child;      // node index, or first primitive of a leaf
+  int prim_count; // 0 for inner nodes
+  float t;        // distance at which the ray enters the box
+};
 
-      float t = intersect_triangle(vertex1, vertex2, vertex3, face.edge1,
-                                   face.edge2, r);
+const int BVH_STACK_SIZE =
+    (parser::BVH_WIDTH - 1) * parser::BVH_MAX_DEPTH + 1;
 
-      if (t > 0.0f && t < min_intersection.t) {
-        Intersection intersection;
-        intersection.point = r.get_point(t);
-        intersection.normal = face.normal;
-        intersection.material = &s.materials[mesh.material_id - 1];
-        intersection.t = t;
-        min_intersection = intersection;
-        min_intersection.is_null = false;
-      }
+// pushes the children hit by the ray so that the nearest one is on top
+inline void push_children(const parser::WideBVHNode &node, int mask,
+                          const float *t_entry, TraversalEntry *stack,
+                          int &stack_size) {
+  const int first = stack_size;
+  while (mask) {
+    const int c = __builtin_ctz(mask);
+    mask &= mask - 1;
+    TraversalEntry entry = {node.child[c], node.prim_count[c], t_entry[c]};
+    int i = stack_size++;
+    for (; i > first && stack[i - 1].t < entry.t; --i) {
+      stack[i] = stack[i - 1];
+    }
+    stack[i] = entry;
+  }
+}
+
+// per ray data of the box tests, the near and far planes of every axis are
+// picked by the sign of the direction so inverted boxes never pass
+struct BoxRay {
+  parser::Vec3f origin;
+  parser::Vec3f inv_direction;
+  int near_x, near_y, near_z;
+};
+
+// a ray from or along a non-finite vector, as off a degenerate primitive,
+// gives NaN slab distances that the min and max of test_children drop, so
+// even empty slots would pass and fill the stack; such a ray hits nothing
+inline bool ray_finite(const Ray &r) {
+  const parser::Vec3f o = r.get_origin(), d = r.get_direction();
+  return std::isfinite(o.x) && std::isfinite(o.y) && std::isfinite(o.z) &&
+         std::isfinite(d.x) && std::isfinite(d.y) && std::isfinite(d.z);
+}
+
+inline BoxRay make_box_ray(const Ray &r) {
+  BoxRay ray;
+  const parser::Vec3f direction = r.get_direction();
+  ray.origin = r.get_origin();
+  ray.inv_direction = {1.0f / direction.x, 1.0f / direction.y,
+                       1.0f / direction.z};
+  ray.near_x = std::signbit(direction.x) ? 1 : 0;
+  ray.near_y = std::signbit(direction.y) ? 3 : 2;
+  ray.near_z = std::signbit(direction.z) ? 5 : 4;
+  return ray;
+}
+
+// leaves tested one primitive at a time, used without a triangle kernel
+inline void intersect_leaf_scalar(const parser::Scene &s, int first,
+                                  int count, const Ray &r, Hit &hit) {
+  const LeafLanes leaf = leaf_lanes(s, first, count);
+  for (int i = first; i < first + count; ++i) {
+    float u = 0.0f, v = 0.0f;
+    const float t = hit_distance(i, leaf, r, s, u, v);
+    if (t > 0.0f && closer_hit(s, t, i, hit)) {
+      hit.t = t;
+      hit.primitive = i;
+      hit.u = u;
+      hit.v = v;
     }
   }
-  return min_intersection;
 }
+
+inline bool occluded_leaf_scalar(const parser::Scene &s, int first, int count,
+                                 const Ray &r, float t_max) {
+  const LeafLanes leaf = leaf_lanes(s, first, count);
+  for (int i = first; i < first + count; ++i) {
+    float u = 0.0f, v = 0.0f;
+    const float t = hit_distance(i, leaf, r, s, u, v);
+    if (t > 0.0f && t < t_max) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the triangle kernels only see triangle lanes, spheres in the leaf are
+// tested separately
+inline void intersect_leaf_spheres(const parser::Scene &s, int first,
+                                   int count, const Ray &r, Hit &hit) {
+  for (int i = first; i < first + count; ++i) {
+    const parser::Primitive &primitive = s.primitives[i];
+    if (primitive.type != parser::SPHERE) {
+      continue;
+    }
+    const parser::Sphere &sphere = s.spheres[primitive.object_id];
+    const float t = intersect_sphere(
+        s.vertex_data[sphere.center_vertex_id - 1], sphere.radius, r);
+    if (t > 0.0f && closer_hit(s, t, i, hit)) {
+      hit.t = t;
+      hit.primitive = i;
+    }
+  }
+}
+
+inline bool occluded_leaf_spheres(const parser::Scene &s, int first,
+                                  int count, const Ray &r, float t_max) {
+  for (int i = first; i < first + count; ++i) {
+    const parser::Primitive &primitive = s.primitives[i];
+    if (primitive.type != parser::SPHERE) {
+      continue;
+    }
+    const parser::Sphere &sphere = s.spheres[primitive.object_id];
+    const float t = intersect_sphere(
+        s.vertex_data[sphere.center_vertex_id - 1], sphere.radius, r);
+    if (t > 0.0f && t < t_max) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+
+// the children are tested four at a time
+namespace sse {
+
+struct NodeRay {
+  __m128 origin_x, origin_y, origin_z;
+  __m128 inv_x, inv_y, inv_z;
+  int near_x, near_y, near_z;
+};
+
+inline NodeRay make_node_ray(const BoxRay &ray) {
+  NodeRay node_ray;
+  node_ray.origin_x = _mm_set1_ps(ray.origin.x);
+  node_ray.origin_y = _mm_set1_ps(ray.origin.y);
+  node_ray.origin_z = _mm_set1_ps(ray.origin.z);
+  node_ray.inv_x = _mm_set1_ps(ray.inv_direction.x);
+  node_ray.inv_y = _mm_set1_ps(ray.inv_direction.y);
+  node_ray.inv_z = _mm_set1_ps(ray.inv_direction.z);
+  node_ray.near_x = ray.near_x;
+  node_ray.near_y = ray.near_y;
+  node_ray.near_z = ray.near_z;
+  return node_ray;
+}
+
+// returns a bit mask of the children hit before t_max
+inline int test_children(const parser::WideBVHNode &node, const NodeRay &ray,
+                         float t_max, float *t_entry) {
+  int mask = 0;
+  for (int half = 0; half < parser::BVH_WIDTH; half += 4) {
+    const __m128 near_x = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(node.bounds[ray.near_x] + half), ray.origin_x),
+        ray.inv_x);
+    const __m128 near_y = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(node.bounds[ray.near_y] + half), ray.origin_y),
+        ray.inv_y);
+    const __m128 near_z = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(node.bounds[ray.near_z] + half), ray.origin_z),
+        ray.inv_z);
+    const __m128 far_x =
+        _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[ray.near_x ^ 1] + half),
+                              ray.origin_x),
+                   ray.inv_x);
+    const __m128 far_y =
+        _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[ray.near_y ^ 1] + half),
+                              ray.origin_y),
+                   ray.inv_y);
+    const __m128 far_z =
+        _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[ray.near_z ^ 1] + half),
+                              ray.origin_z),
+                   ray.inv_z);
+    const __m128 t_near =
+        _mm_max_ps(_mm_max_ps(near_x, near_y),
+                   _mm_max_ps(near_z, _mm_setzero_ps()));
+    const __m128 t_far = _mm_min_ps(
+        _mm_mul_ps(_mm_min_ps(_mm_min_ps(far_x, far_y), far_z),
+                   _mm_set1_ps(BOX_SLACK)),
+        _mm_set1_ps(t_max));
+    _mm_storeu_ps(t_entry + half, t_near);
+    mask |= _mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) << half;
+  }
+  return mask;
+}
+
+struct LeafRay {};
+
+inline LeafRay make_leaf_ray(const Ray &) { return LeafRay(); }
+
+inline void intersect_leaf(const parser::Scene &s, int first, int count,
+                           const LeafRay &, const Ray &r, Hit &hit) {
+  intersect_leaf_scalar(s, first, count, r, hit);
+}
+
+inline bool occluded_leaf(const parser::Scene &s, int first, int count,
+                          const LeafRay &, const Ray &r, float t_max) {
+  return occluded_leaf_scalar(s, first, count, r, t_max);
+}
+
+#include "bvh_traversal.inl"
+
+} // namespace sse
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+
+// all eight children in one pass, the slabs are computed as
+// bound * inv - origin * inv so each one is a single fused multiply-add
+namespace avx2 {
+
+struct NodeRay {
+  __m256 origin_x, origin_y, origin_z;
+  __m256 inv_x, inv_y, inv_z;
+  int near_x, near_y, near_z;
+};
+
+inline NodeRay make_node_ray(const BoxRay &ray) {
+  NodeRay node_ray;
+  node_ray.inv_x = _mm256_set1_ps(ray.inv_direction.x);
+  node_ray.inv_y = _mm256_set1_ps(ray.inv_direction.y);
+  node_ray.inv_z = _mm256_set1_ps(ray.inv_direction.z);
+  node_ray.origin_x = _mm256_set1_ps(ray.origin.x * ray.inv_direction.x);
+  node_ray.origin_y = _mm256_set1_ps(ray.origin.y * ray.inv_direction.y);
+  node_ray.origin_z = _mm256_set1_ps(ray.origin.z * ray.inv_direction.z);
+  node_ray.near_x = ray.near_x;
+  node_ray.near_y = ray.near_y;
+  node_ray.near_z = ray.near_z;
+  return node_ray;
+}
+
+// returns a bit mask of the children hit before t_max
+inline int test_children(const parser::WideBVHNode &node, const NodeRay &ray,
+                         float t_max, float *t_entry) {
+  const __m256 near_x = _mm256_fmsub_ps(
+      _mm256_load_ps(node.bounds[ray.near_x]), ray.inv_x, ray.origin_x);
+  const __m256 near_y = _mm256_fmsub_ps(
+      _mm256_load_ps(node.bounds[ray.near_y]), ray.inv_y, ray.origin_y);
+  const __m256 near_z = _mm256_fmsub_ps(
+      _mm256_load_ps(node.bounds[ray.near_z]), ray.inv_z, ray.origin_z);
+  const __m256 far_x = _mm256_fmsub_ps(
+      _mm256_load_ps(node.bounds[ray.near_x ^ 1]), ray.inv_x, ray.origin_x);
+  const __m256 far_y = _mm256_fmsub_ps(
+      _mm256_load_ps(node.bounds[ray.near_y ^ 1]), ray.inv_y, ray.origin_y);
+  const __m256 far_z = _mm256_fmsub_ps(
+      _mm256_load_ps(node.bounds[ray.near_z ^ 1]), ray.inv_z, ray.origin_z);
+  const __m256 t_near =
+      _mm256_max_ps(_mm256_max_ps(near_x, near_y),
+                    _mm256_max_ps(near_z, _mm256_setzero_ps()));
+  const __m256 t_far = _mm256_min_ps(
+      _mm256_mul_ps(_mm256_min_ps(_mm256_min_ps(far_x, far_y), far_z),
+                    _mm256_set1_ps(BOX_SLACK)),
+      _mm256_set1_ps(t_max));
+  _mm256_storeu_ps(t_entry, t_near);
+  return _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+}
+
+struct LeafRay {
+  __m256 origin_x, origin_y, origin_z;
+  __m256 direction_x, direction_y, direction_z;
+};
+
+inline LeafRay make_leaf_ray(const Ray &r) {
+  const parser::Vec3f origin = r.get_origin();
+  const parser::Vec3f direction = r.get_direction();
+  LeafRay leaf_ray;
+  leaf_ray.origin_x = _mm256_set1_ps(origin.x);
+  leaf_ray.origin_y = _mm256_set1_ps(origin.y);
+  leaf_ray.origin_z = _mm256_set1_ps(origin.z);
+  leaf_ray.direction_x = _mm256_set1_ps(direction.x);
+  leaf_ray.direction_y = _mm256_set1_ps(direction.y);
+  leaf_ray.direction_z = _mm256_set1_ps(direction.z);
+  return leaf_ray;
+}
+
+// Moller-Trumbore on the eight triangle lanes starting at first, the
+// operations follow the scalar intersect_triangle one to one so both give
+// the same distances. Returns the mask of the first count lanes hit in
+// front of t_max.
+inline int intersect_triangles(const TriangleLanes &triangles,
+                               int first, int count, const LeafRay &ray,
+                               float t_max, __m256 &t, __m256 &u,
+                               __m256 &v) {
+  const __m256 edge1_x = _mm256_loadu_ps(triangles.edge1_x + first);
+  const __m256 edge1_y = _mm256_loadu_ps(triangles.edge1_y + first);
+  const __m256 edge1_z = _mm256_loadu_ps(triangles.edge1_z + first);
+  const __m256 edge2_x = _mm256_loadu_ps(triangles.edge2_x + first);
+  const __m256 edge2_y = _mm256_loadu_ps(triangles.edge2_y + first);
+  const __m256 edge2_z = _mm256_loadu_ps(triangles.edge2_z + first);
+
+  // h = direction x edge2, a = edge1 . h
+  const __m256 h_x = _mm256_sub_ps(_mm256_mul_ps(ray.direction_y, edge2_z),
+                                   _mm256_mul_ps(ray.direction_z, edge2_y));
+  const __m256 h_y = _mm256_sub_ps(_mm256_mul_ps(ray.direction_z, edge2_x),
+                                   _mm256_mul_ps(ray.direction_x, edge2_z));
+  const __m256 h_z = _mm256_sub_ps(_mm256_mul_ps(ray.direction_x, edge2_y),
+                                   _mm256_mul_ps(ray.direction_y, edge2_x));
+  const __m256 a = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(edge1_x, h_x), _mm256_mul_ps(edge1_y, h_y)),
+      _mm256_mul_ps(edge1_z, h_z));
+  const __m256 f = _mm256_div_ps(_mm256_set1_ps(1.0f), a);
+
+  // s = origin - v0, u = f * (s . h)
+  const __m256 s_x =
+      _mm256_sub_ps(ray.origin_x, _mm256_loadu_ps(triangles.v0_x + first));
+  const __m256 s_y =
+      _mm256_sub_ps(ray.origin_y, _mm256_loadu_ps(triangles.v0_y + first));
+  const __m256 s_z =
+      _mm256_sub_ps(ray.origin_z, _mm256_loadu_ps(triangles.v0_z + first));
+  u = _mm256_mul_ps(
+      f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(s_x, h_x),
+                                     _mm256_mul_ps(s_y, h_y)),
+                       _mm256_mul_ps(s_z, h_z)));
+
+  // q = s x edge1, v = f * (direction . q), t = f * (edge2 . q)
+  const __m256 q_x = _mm256_sub_ps(_mm256_mul_ps(s_y, edge1_z),
+                                   _mm256_mul_ps(s_z, edge1_y));
+  const __m256 q_y = _mm256_sub_ps(_mm256_mul_ps(s_z, edge1_x),
+                                   _mm256_mul_ps(s_x, edge1_z));
+  const __m256 q_z = _mm256_sub_ps(_mm256_mul_ps(s_x, edge1_y),
+                                   _mm256_mul_ps(s_y, edge1_x));
+  v = _mm256_mul_ps(
+      f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ray.direction_x, q_x),
+                                     _mm256_mul_ps(ray.direction_y, q_y)),
+                       _mm256_mul_ps(ray.direction_z, q_z)));
+  t = _mm256_mul_ps(
+      f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge2_x, q_x),
+                                     _mm256_mul_ps(edge2_y, q_y)),
+                       _mm256_mul_ps(edge2_z, q_z)));
+
+  const __m256 epsilon = _mm256_set1_ps(std::numeric_limits<float>::epsilon());
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 abs_a = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+  __m256 valid = _mm256_cmp_ps(abs_a, epsilon, _CMP_GE_OQ);
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+  valid =
+      _mm256_and_ps(valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, epsilon, _CMP_GT_OQ));
+  valid = _mm256_and_ps(
+      valid, _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+  return _mm256_movemask_ps(valid) & ((1 << count) - 1);
+}
+
+inline void intersect_leaf(const parser::Scene &s, int first, int count,
+                           const LeafRay &leaf_ray, const Ray &r, Hit &hit) {
+  const LeafLanes leaf = leaf_lanes(s, first, count);
+  for (int base = first; base < first + count; base += 8) {
+    __m256 t, u, v;
+    const int mask =
+        intersect_triangles(leaf.lanes, base - leaf.offset,
+                            std::min(8, first + count - base), leaf_ray,
+                            tie_limit(hit.t), t, u, v);
+    if (mask) {
+      float t_lanes[8], u_lanes[8], v_lanes[8];
+      _mm256_storeu_ps(t_lanes, t);
+      _mm256_storeu_ps(u_lanes, u);
+      _mm256_storeu_ps(v_lanes, v);
+      take_closest_lane(s, base, mask, t_lanes, u_lanes, v_lanes, hit);
+    }
+  }
+  if (!s.spheres.empty()) {
+    intersect_leaf_spheres(s, first, count, r, hit);
+  }
+}
+
+inline bool occluded_leaf(const parser::Scene &s, int first, int count,
+                          const LeafRay &leaf_ray, const Ray &r, float t_max) {
+  const LeafLanes leaf = leaf_lanes(s, first, count);
+  for (int base = first; base < first + count; base += 8) {
+    __m256 t, u, v;
+    if (intersect_triangles(leaf.lanes, base - leaf.offset,
+                            std::min(8, first + count - base), leaf_ray,
+                            t_max, t, u, v)) {
+      return true;
+    }
+  }
+  return !s.spheres.empty() &&
+         occluded_leaf_spheres(s, first, count, r, t_max);
+}
+
+#include "bvh_traversal.inl"
+
+} // namespace avx2
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,avx512f")
+
+// the node test is the AVX2 one, a node has eight children, while triangles
+// are tested sixteen lanes at a time
+namespace avx512 {
+
+using avx2::NodeRay;
+using avx2::make_node_ray;
+using avx2::test_children;
+
+// leaves of up to eight primitives are cheaper with the AVX2 kernel
+struct LeafRay {
+  avx2::LeafRay narrow;
+  __m512 origin_x, origin_y, origin_z;
+  __m512 direction_x, direction_y, direction_z;
+};
+
+inline LeafRay make_leaf_ray(const Ray &r) {
+  const parser::Vec3f origin = r.get_origin();
+  const parser::Vec3f direction = r.get_direction();
+  LeafRay leaf_ray;
+  leaf_ray.narrow = avx2::make_leaf_ray(r);
+  leaf_ray.origin_x = _mm512_set1_ps(origin.x);
+  leaf_ray.origin_y = _mm512_set1_ps(origin.y);
+  leaf_ray.origin_z = _mm512_set1_ps(origin.z);
+  leaf_ray.direction_x = _mm512_set1_ps(direction.x);
+  leaf_ray.direction_y = _mm512_set1_ps(direction.y);
+  leaf_ray.direction_z = _mm512_set1_ps(direction.z);
+  return leaf_ray;
+}
+
+// sixteen lane version of avx2::intersect_triangles
+inline __mmask16 intersect_triangles(const TriangleLanes &triangles,
+                                     int first, int count, const LeafRay &ray,
+                                     float t_max, __m512 &t, __m512 &u,
+                                     __m512 &v) {
+  const __m512 edge1_x = _mm512_loadu_ps(triangles.edge1_x + first);
+  const __m512 edge1_y = _mm512_loadu_ps(triangles.edge1_y + first);
+  const __m512 edge1_z = _mm512_loadu_ps(triangles.edge1_z + first);
+  const __m512 edge2_x = _mm512_loadu_ps(triangles.edge2_x + first);
+  const __m512 edge2_y = _mm512_loadu_ps(triangles.edge2_y + first);
+  const __m512 edge2_z = _mm512_loadu_ps(triangles.edge2_z + first);
+
+  const __m512 h_x = _mm512_sub_ps(_mm512_mul_ps(ray.direction_y, edge2_z),
+                                   _mm512_mul_ps(ray.direction_z, edge2_y));
+  const __m512 h_y = _mm512_sub_ps(_mm512_mul_ps(ray.direction_z, edge2_x),
+                                   _mm512_mul_ps(ray.direction_x, edge2_z));
+  const __m512 h_z = _mm512_sub_ps(_mm512_mul_ps(ray.direction_x, edge2_y),
+                                   _mm512_mul_ps(ray.direction_y, edge2_x));
+  const __m512 a = _mm512_add_ps(
+      _mm512_add_ps(_mm512_mul_ps(edge1_x, h_x), _mm512_mul_ps(edge1_y, h_y)),
+      _mm512_mul_ps(edge1_z, h_z));
+  const __m512 f = _mm512_div_ps(_mm512_set1_ps(1.0f), a);
+
+  const __m512 s_x =
+      _mm512_sub_ps(ray.origin_x, _mm512_loadu_ps(triangles.v0_x + first));
+  const __m512 s_y =
+      _mm512_sub_ps(ray.origin_y, _mm512_loadu_ps(triangles.v0_y + first));
+  const __m512 s_z =
+      _mm512_sub_ps(ray.origin_z, _mm512_loadu_ps(triangles.v0_z + first));
+  u = _mm512_mul_ps(
+      f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(s_x, h_x),
+                                     _mm512_mul_ps(s_y, h_y)),
+                       _mm512_mul_ps(s_z, h_z)));
+
+  const __m512 q_x = _mm512_sub_ps(_mm512_mul_ps(s_y, edge1_z),
+                                   _mm512_mul_ps(s_z, edge1_y));
+  const __m512 q_y = _mm512_sub_ps(_mm512_mul_ps(s_z, edge1_x),
+                                   _mm512_mul_ps(s_x, edge1_z));
+  const __m512 q_z = _mm512_sub_ps(_mm512_mul_ps(s_x, edge1_y),
+                                   _mm512_mul_ps(s_y, edge1_x));
+  v = _mm512_mul_ps(
+      f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ray.direction_x, q_x),
+                                     _mm512_mul_ps(ray.direction_y, q_y)),
+                       _mm512_mul_ps(ray.direction_z, q_z)));
+  t = _mm512_mul_ps(
+      f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(edge2_x, q_x),
+                                     _mm512_mul_ps(edge2_y, q_y)),
+                       _mm512_mul_ps(edge2_z, q_z)));
+
+  const __m512 epsilon = _mm512_set1_ps(std::numeric_limits<float>::epsilon());
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 one = _mm512_set1_ps(1.0f);
+  __mmask16 valid = static_cast<__mmask16>((1u << count) - 1);
+  valid = _mm512_mask_cmp_ps_mask(valid, _mm512_abs_ps(a), epsilon,
+                                  _CMP_GE_OQ);
+  valid = _mm512_mask_cmp_ps_mask(valid, u, zero, _CMP_GE_OQ);
+  valid = _mm512_mask_cmp_ps_mask(valid, u, one, _CMP_LE_OQ);
+  valid = _mm512_mask_cmp_ps_mask(valid, v, zero, _CMP_GE_OQ);
+  valid =
+      _mm512_mask_cmp_ps_mask(valid, _mm512_add_ps(u, v), one, _CMP_LE_OQ);
+  valid = _mm512_mask_cmp_ps_mask(valid, t, epsilon, _CMP_GT_OQ);
+  valid = _mm512_mask_cmp_ps_mask(valid, t, _mm512_set1_ps(t_max),
+                                  _CMP_LT_OQ);
+  return valid;
+}
+
+inline void intersect_leaf(const parser::Scene &s, int first, int count,
+                           const LeafRay &leaf_ray, const Ray &r, Hit &hit) {
+  if (count <= 8) {
+    avx2::intersect_leaf(s, first, count, leaf_ray.narrow, r, hit);
+    return;
+  }
+  const LeafLanes leaf = leaf_lanes(s, first, count);
+  for (int base = first; base < first + count; base += 16) {
+    __m512 t, u, v;
+    const __mmask16 mask =
+        intersect_triangles(leaf.lanes, base - leaf.offset,
+                            std::min(16, first + count - base), leaf_ray,
+                            tie_limit(hit.t), t, u, v);
+    if (mask) {
+      float t_lanes[16], u_lanes[16], v_lanes[16];
+      _mm512_storeu_ps(t_lanes, t);
+      _mm512_storeu_ps(u_lanes, u);
+      _mm512_storeu_ps(v_lanes, v);
+      take_closest_lane(s, base, mask, t_lanes, u_lanes, v_lanes, hit);
+    }
+  }
+  if (!s.spheres.empty()) {
+    intersect_leaf_spheres(s, first, count, r, hit);
+  }
+}
+
+inline bool occluded_leaf(const parser::Scene &s, int first, int count,
+                          const LeafRay &leaf_ray, const Ray &r, float t_max) {
+  if (count <= 8) {
+    return avx2::occluded_leaf(s, first, count, leaf_ray.narrow, r, t_max);
+  }
+  const LeafLanes leaf = leaf_lanes(s, first, count);
+  for (int base = first; base < first + count; base += 16) {
+    __m512 t, u, v;
+    if (intersect_triangles(leaf.lanes, base - leaf.offset,
+                            std::min(16, first + count - base), leaf_ray,
+                            t_max, t, u, v)) {
+      return true;
+    }
+  }
+  return !s.spheres.empty() &&
+         occluded_leaf_spheres(s, first, count, r, t_max);
+}
+
+#include "bvh_traversal.inl"
+
+} // namespace avx512
+
+#pragma GCC pop_options
 #endif
@@ -0,0 +1,37 @@
+#include "mapped_file.h"
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &path) : begin(NULL), length(0) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Error: " + path + " cannot be opened.");
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    close(fd);
+    throw std::runtime_error("Error: " + path + " cannot be read.");
+  }
+  length = status.st_size;
+  if (length > 0) {
+    void *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Error: " + path + " cannot be mapped.");
+    }
+    // the loaders read front to back
+    madvise(mapping, length, MADV_SEQUENTIAL);
+    begin = static_cast<const char *>(mapping);
+  }
+  // the mapping keeps its own reference to the file
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (begin) {
+    munmap(const_cast<char *>(begin), length);
+  }
+}
@@ -0,0 +1,27 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+// Read-only mapping of a whole file, unmapped when destroyed. The pages are
+// read from the page cache on first touch instead of being copied into a
+// heap buffer.
+class MappedFile {
+public:
+  // throws if the file cannot be opened or mapped
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+
+  const char *data() const { return begin; }
+  size_t size() const { return length; }
+
+private:
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+  const char *begin;
+  size_t length;
+};
+
+#endif // MAPPED_FILE_H
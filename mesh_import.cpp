@@ -0,0 +1,545 @@
+#include "mesh_import.h"
+#include "number_scanner.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const size_t CHUNK_BYTES = 1 << 20;
+
+// Sequential reads through a buffer of about one chunk. A record or line
+// that crosses the end of the buffer is moved to the front before the next
+// chunk is read behind it, so nothing but the buffer is ever held.
+class ChunkedReader {
+public:
+  explicit ChunkedReader(const std::string &path)
+      : path(path), buffer(CHUNK_BYTES), begin(0), end(0), read_total(0),
+        at_eof(false) {
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Error: " + path + " cannot be opened.");
+    }
+    struct stat status;
+    file_size = fstat(fd, &status) == 0 ? status.st_size : 0;
+  }
+  ~ChunkedReader() { close(fd); }
+
+  // true when count bytes are available at data()
+  bool fill(size_t count) {
+    while (end - begin < count) {
+      if (at_eof) {
+        return false;
+      }
+      read_more(count);
+    }
+    return true;
+  }
+  const char *data() const { return buffer.data() + begin; }
+  void consume(size_t count) { begin += count; }
+
+  // unread bytes of the file as it was opened, counts read from a header
+  // are checked against it before anything is sized by them
+  size_t remaining() const {
+    return (read_total < file_size ? file_size - read_total : 0) +
+           (end - begin);
+  }
+
+  // the next line without its terminator, valid until the next call
+  bool line(const char *&first, const char *&last) {
+    size_t searched = 0;
+    for (;;) {
+      const char *newline = static_cast<const char *>(std::memchr(
+          buffer.data() + begin + searched, '\n', end - begin - searched));
+      if (newline != NULL || (at_eof && begin < end)) {
+        first = buffer.data() + begin;
+        last = newline != NULL ? newline : buffer.data() + end;
+        begin = last - buffer.data() + (newline != NULL);
+        if (last > first && last[-1] == '\r') {
+          --last;
+        }
+        return true;
+      }
+      if (at_eof) {
+        return false;
+      }
+      searched = end - begin;
+      read_more(searched + 1);
+    }
+  }
+
+private:
+  ChunkedReader(const ChunkedReader &);
+  ChunkedReader &operator=(const ChunkedReader &);
+
+  // moves the unread bytes to the front and reads once behind them
+  void read_more(size_t count) {
+    std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+    end -= begin;
+    begin = 0;
+    // one byte is kept for a NUL so numbers never run past the data
+    if (buffer.size() < count + 1 || end + 1 == buffer.size()) {
+      buffer.resize(std::max(count + 1, 2 * buffer.size()));
+    }
+    ssize_t n;
+    do {
+      n = ::read(fd, buffer.data() + end, buffer.size() - 1 - end);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+      throw std::runtime_error("Error: " + path + " cannot be read.");
+    }
+    end += n;
+    read_total += n;
+    buffer[end] = '\0';
+    at_eof = n == 0;
+  }
+
+  std::string path;
+  std::vector<char> buffer;
+  size_t begin, end; // unread bytes of buffer
+  size_t read_total, file_size;
+  bool at_eof;
+  int fd;
+};
+
+bool is_blank(char c) { return c == ' ' || c == '\t'; }
+
+std::vector<std::string> split(const char *first, const char *last) {
+  std::vector<std::string> words;
+  while (first < last) {
+    while (first < last && is_blank(*first)) {
+      ++first;
+    }
+    const char *word = first;
+    while (first < last && !is_blank(*first)) {
+      ++first;
+    }
+    if (first > word) {
+      words.push_back(std::string(word, first));
+    }
+  }
+  return words;
+}
+
+// splits the polygons of a file into triangles for the sink, ids are
+// checked against the vertex count of the file once it is known
+class Triangulator {
+public:
+  explicit Triangulator(MeshSink &sink)
+      : sink(sink), max_id(-1), out_of_range(false) {}
+
+  // ids are 0-based into the vertices of the file, polygons are fanned
+  // around their first vertex
+  void polygon(const long long *ids, int count) {
+    for (int k = 0; k < count; ++k) {
+      out_of_range = out_of_range || ids[k] < 0 || ids[k] >= INT_MAX;
+      max_id = std::max(max_id, ids[k]);
+    }
+    if (out_of_range) {
+      return;
+    }
+    for (int k = 2; k < count; ++k) {
+      sink.triangle(ids[0], ids[k - 1], ids[k]);
+    }
+  }
+
+  void finish(const std::string &path, long long vertex_count) {
+    if (out_of_range || max_id >= vertex_count) {
+      throw std::runtime_error("Error: " + path +
+                               " has a face with a missing vertex.");
+    }
+  }
+
+private:
+  MeshSink &sink;
+  long long max_id;
+  bool out_of_range;
+};
+
+// appends the file to the vertices and faces of the scene
+class SceneSink : public MeshSink {
+public:
+  SceneSink(std::vector<parser::Vec3f> &vertex_data,
+            std::vector<parser::Face> &faces)
+      : vertex_data(vertex_data), faces(faces), base(vertex_data.size()) {}
+
+  void vertex(const parser::Vec3f &v) { vertex_data.push_back(v); }
+
+  void triangle(int v0_id, int v1_id, int v2_id) {
+    parser::Face face = parser::Face();
+    face.v0_id = base + v0_id + 1;
+    face.v1_id = base + v1_id + 1;
+    face.v2_id = base + v2_id + 1;
+    faces.push_back(face);
+  }
+
+  // ids past INT_MAX wrapped around, the file is not used then
+  void finish(const std::string &path) {
+    if (vertex_data.size() > (size_t)INT_MAX) {
+      throw std::runtime_error("Error: " + path +
+                               " has more vertices than a scene can hold.");
+    }
+  }
+
+private:
+  std::vector<parser::Vec3f> &vertex_data;
+  std::vector<parser::Face> &faces;
+  long long base;
+};
+
+enum PlyType {
+  PLY_INT8,
+  PLY_UINT8,
+  PLY_INT16,
+  PLY_UINT16,
+  PLY_INT32,
+  PLY_UINT32,
+  PLY_FLOAT32,
+  PLY_FLOAT64
+};
+
+struct PlyProperty {
+  std::string name;
+  bool is_list;
+  PlyType count_type; // lists only
+  PlyType type;
+};
+
+struct PlyElement {
+  std::string name;
+  long long count;
+  std::vector<PlyProperty> properties;
+};
+
+bool ply_type(const std::string &name, PlyType &type) {
+  static const struct {
+    const char *name;
+    PlyType type;
+  } NAMES[] = {{"char", PLY_INT8},     {"int8", PLY_INT8},
+               {"uchar", PLY_UINT8},   {"uint8", PLY_UINT8},
+               {"short", PLY_INT16},   {"int16", PLY_INT16},
+               {"ushort", PLY_UINT16}, {"uint16", PLY_UINT16},
+               {"int", PLY_INT32},     {"int32", PLY_INT32},
+               {"uint", PLY_UINT32},   {"uint32", PLY_UINT32},
+               {"float", PLY_FLOAT32}, {"float32", PLY_FLOAT32},
+               {"double", PLY_FLOAT64}, {"float64", PLY_FLOAT64}};
+  for (size_t i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); ++i) {
+    if (name == NAMES[i].name) {
+      type = NAMES[i].type;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t ply_size(PlyType type) {
+  static const size_t SIZES[] = {1, 1, 2, 2, 4, 4, 4, 8};
+  return SIZES[type];
+}
+
+// a binary value in the byte order of the file
+double ply_value(const char *data, PlyType type, bool swap) {
+  unsigned char bytes[8];
+  const size_t size = ply_size(type);
+  for (size_t i = 0; i < size; ++i) {
+    bytes[i] = data[swap ? size - 1 - i : i];
+  }
+  switch (type) {
+  case PLY_INT8:
+    return (int8_t)bytes[0];
+  case PLY_UINT8:
+    return bytes[0];
+  case PLY_INT16: {
+    int16_t v;
+    std::memcpy(&v, bytes, 2);
+    return v;
+  }
+  case PLY_UINT16: {
+    uint16_t v;
+    std::memcpy(&v, bytes, 2);
+    return v;
+  }
+  case PLY_INT32: {
+    int32_t v;
+    std::memcpy(&v, bytes, 4);
+    return v;
+  }
+  case PLY_UINT32: {
+    uint32_t v;
+    std::memcpy(&v, bytes, 4);
+    return v;
+  }
+  case PLY_FLOAT32: {
+    float v;
+    std::memcpy(&v, bytes, 4);
+    return v;
+  }
+  default: {
+    double v;
+    std::memcpy(&v, bytes, 8);
+    return v;
+  }
+  }
+}
+
+int find_property(const PlyElement &element, const char *name, bool is_list) {
+  for (size_t p = 0; p < element.properties.size(); ++p) {
+    if (element.properties[p].name == name &&
+        element.properties[p].is_list == is_list) {
+      return p;
+    }
+  }
+  return -1;
+}
+
+} // namespace
+
+void import_ply(const std::string &path, MeshSink &sink) {
+  ChunkedReader reader(path);
+  const std::runtime_error malformed("Error: " + path +
+                                     " is not a valid PLY file.");
+
+  const char *first, *last;
+  if (!reader.line(first, last) || std::string(first, last) != "ply") {
+    throw malformed;
+  }
+  bool ascii = false, swap = false;
+  std::vector<PlyElement> elements;
+  for (;;) {
+    if (!reader.line(first, last)) {
+      throw malformed;
+    }
+    const std::vector<std::string> words = split(first, last);
+    if (words.empty() || words[0] == "comment" || words[0] == "obj_info") {
+      continue;
+    }
+    if (words[0] == "end_header") {
+      break;
+    }
+    if (words[0] == "format" && words.size() == 3) {
+      ascii = words[1] == "ascii";
+      const bool big_endian = words[1] == "binary_big_endian";
+      if (!ascii && !big_endian && words[1] != "binary_little_endian") {
+        throw malformed;
+      }
+      swap = big_endian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+    } else if (words[0] == "element" && words.size() == 3) {
+      PlyElement element;
+      element.name = words[1];
+      char *count_end;
+      errno = 0;
+      element.count = std::strtoll(words[2].c_str(), &count_end, 10);
+      if (*count_end != '\0' || errno != 0 || element.count < 0) {
+        throw malformed;
+      }
+      elements.push_back(element);
+    } else if (words[0] == "property" && !elements.empty()) {
+      PlyProperty property;
+      property.is_list = words.size() == 5 && words[1] == "list";
+      if (property.is_list ? !ply_type(words[2], property.count_type) ||
+                                 property.count_type >= PLY_FLOAT32 ||
+                                 !ply_type(words[3], property.type)
+                           : words.size() != 3 ||
+                                 !ply_type(words[1], property.type)) {
+        throw malformed;
+      }
+      property.name = words.back();
+      elements.back().properties.push_back(property);
+    } else {
+      throw malformed;
+    }
+  }
+
+  long long vertex_count = 0;
+  Triangulator triangulator(sink);
+  std::vector<long long> polygon;
+  for (size_t e = 0; e < elements.size(); ++e) {
+    const PlyElement &element = elements[e];
+    // a record takes at least a byte per value, a list at least its count;
+    // an ascii record also a separator or line end per value
+    size_t record_size = 0;
+    for (size_t p = 0; p < element.properties.size(); ++p) {
+      const PlyProperty &property = element.properties[p];
+      record_size += ascii ? 2
+                     : ply_size(property.is_list ? property.count_type
+                                                 : property.type);
+    }
+    if (ascii) {
+      record_size = std::max<size_t>(record_size, 2) - 1;
+    } else if (record_size == 0) {
+      // binary records without properties take no bytes, none to read
+      continue;
+    }
+    if ((unsigned long long)element.count > reader.remaining() / record_size) {
+      throw malformed;
+    }
+    const bool is_vertex = element.name == "vertex";
+    const bool is_face = element.name == "face";
+    int targets[3] = {-1, -1, -1}; // x y z, or the index list at [0]
+    if (is_vertex) {
+      targets[0] = find_property(element, "x", false);
+      targets[1] = find_property(element, "y", false);
+      targets[2] = find_property(element, "z", false);
+      if (targets[0] < 0 || targets[1] < 0 || targets[2] < 0) {
+        throw malformed;
+      }
+      vertex_count = element.count;
+    } else if (is_face) {
+      targets[0] = find_property(element, "vertex_indices", true);
+      if (targets[0] < 0) {
+        targets[0] = find_property(element, "vertex_index", true);
+      }
+    }
+
+    for (long long r = 0; r < element.count; ++r) {
+      float position[3] = {0.0f, 0.0f, 0.0f};
+      polygon.clear();
+      NumberScanner numbers(NULL, NULL);
+      if (ascii) {
+        if (!reader.line(first, last)) {
+          throw malformed;
+        }
+        numbers = NumberScanner(first, last);
+      }
+      for (size_t p = 0; p < element.properties.size(); ++p) {
+        const PlyProperty &property = element.properties[p];
+        const int axis = !is_vertex           ? -1
+                         : (int)p == targets[0] ? 0
+                         : (int)p == targets[1] ? 1
+                         : (int)p == targets[2] ? 2
+                                                : -1;
+        const bool wanted = is_face && (int)p == targets[0];
+        if (ascii) {
+          int count = 1;
+          if (property.is_list && (!numbers.next(count) || count < 0)) {
+            throw malformed;
+          }
+          for (int i = 0; i < count; ++i) {
+            float value = 0.0f;
+            int id = 0;
+            if (wanted ? !numbers.next(id) : !numbers.next(value)) {
+              throw malformed;
+            }
+            if (axis >= 0) {
+              position[axis] = value;
+            } else if (wanted) {
+              polygon.push_back(id);
+            }
+          }
+          continue;
+        }
+        long long count = 1;
+        if (property.is_list) {
+          if (!reader.fill(ply_size(property.count_type))) {
+            throw malformed;
+          }
+          count = ply_value(reader.data(), property.count_type, swap);
+          reader.consume(ply_size(property.count_type));
+        }
+        const size_t size = ply_size(property.type);
+        if (count < 0 ||
+            (unsigned long long)count > reader.remaining() / size ||
+            !reader.fill(count * size)) {
+          throw malformed;
+        }
+        if (axis >= 0) {
+          position[axis] = ply_value(reader.data(), property.type, swap);
+        } else if (wanted) {
+          for (long long i = 0; i < count; ++i) {
+            polygon.push_back(
+                ply_value(reader.data() + i * size, property.type, swap));
+          }
+        }
+        reader.consume(count * size);
+      }
+
+      if (is_vertex) {
+        sink.vertex({position[0], position[1], position[2]});
+      } else if (polygon.size() >= 3) {
+        triangulator.polygon(polygon.data(), polygon.size());
+      }
+    }
+  }
+  triangulator.finish(path, vertex_count);
+}
+
+void import_obj(const std::string &path, MeshSink &sink) {
+  ChunkedReader reader(path);
+  long long vertex_count = 0;
+  Triangulator triangulator(sink);
+  std::vector<long long> polygon;
+
+  const char *first, *last;
+  for (long long line = 1; reader.line(first, last); ++line) {
+    while (first < last && is_blank(*first)) {
+      ++first;
+    }
+    if (last - first < 2 || !is_blank(first[1])) {
+      continue;
+    }
+    if (first[0] == 'v') {
+      NumberScanner numbers(first + 1, last);
+      parser::Vec3f vertex;
+      if (!numbers.next(vertex.x) || !numbers.next(vertex.y) ||
+          !numbers.next(vertex.z)) {
+        throw std::runtime_error("Error: " + path + " line " +
+                                 std::to_string(line) + " is not a vertex.");
+      }
+      sink.vertex(vertex);
+      ++vertex_count;
+    } else if (first[0] == 'f') {
+      // v, v/vt, v//vn or v/vt/vn, only v is used
+      polygon.clear();
+      const char *c = first + 1;
+      while (c < last) {
+        while (c < last && is_blank(*c)) {
+          ++c;
+        }
+        if (c == last) {
+          break;
+        }
+        const bool negative = *c == '-';
+        c += negative;
+        long long id = 0;
+        const char *digits = c;
+        for (; c < last && *c >= '0' && *c <= '9'; ++c) {
+          id = id * 10 + (*c - '0');
+        }
+        if (c == digits || id == 0) {
+          throw std::runtime_error("Error: " + path + " line " +
+                                   std::to_string(line) +
+                                   " is not a face.");
+        }
+        polygon.push_back(negative ? vertex_count - id : id - 1);
+        while (c < last && !is_blank(*c)) {
+          ++c;
+        }
+      }
+      triangulator.polygon(polygon.data(), polygon.size());
+    }
+  }
+  triangulator.finish(path, vertex_count);
+}
+
+void import_ply(const std::string &path,
+                std::vector<parser::Vec3f> &vertex_data,
+                std::vector<parser::Face> &faces) {
+  SceneSink sink(vertex_data, faces);
+  import_ply(path, sink);
+  sink.finish(path);
+}
+
+void import_obj(const std::string &path,
+                std::vector<parser::Vec3f> &vertex_data,
+                std::vector<parser::Face> &faces) {
+  SceneSink sink(vertex_data, faces);
+  import_obj(path, sink);
+  sink.finish(path);
+}
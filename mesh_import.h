@@ -0,0 +1,43 @@
+#ifndef MESH_IMPORT_H
+#define MESH_IMPORT_H
+
+#include "parser.h"
+#include <string>
+#include <vector>
+
+// Mesh files referenced by <Faces plyFile="..."/> or <Faces objFile="..."/>.
+// The file is read in fixed size chunks, never whole. Both throw if the
+// file is malformed.
+
+// Receives a mesh file as it is read: its vertices in order, and its
+// polygons split into triangles whose ids are 0-based into the vertices of
+// the file. A triangle may come before the vertices it uses; the ids are
+// checked against the vertex count only once the whole file is read, the
+// import throws then if one is out of range.
+class MeshSink {
+public:
+  virtual ~MeshSink() {}
+  virtual void vertex(const parser::Vec3f &v) = 0;
+  virtual void triangle(int v0_id, int v1_id, int v2_id) = 0;
+};
+
+// ascii, binary_little_endian and binary_big_endian PLY, x y z of the
+// vertex element and the vertex_indices list of the face element are read,
+// other properties and elements are skipped
+void import_ply(const std::string &path, MeshSink &sink);
+
+// v and f lines of a Wavefront OBJ, including v/vt/vn references and
+// negative (relative) indices; everything else is ignored
+void import_obj(const std::string &path, MeshSink &sink);
+
+// The vertices of the file are appended to vertex_data and its triangles
+// to faces, with 1-based ids that point past the vertices that were
+// already there; only the ids of the faces are set.
+void import_ply(const std::string &path,
+                std::vector<parser::Vec3f> &vertex_data,
+                std::vector<parser::Face> &faces);
+void import_obj(const std::string &path,
+                std::vector<parser::Vec3f> &vertex_data,
+                std::vector<parser::Face> &faces);
+
+#endif // MESH_IMPORT_H
@@ -0,0 +1,165 @@
+#ifndef NUMBER_SCANNER_H
+#define NUMBER_SCANNER_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <emmintrin.h>
+
+// Reads whitespace separated numbers from a range of text without a stream
+// or locale. A float whose digits fit in 24 bits and whose power of ten is
+// at most 10 is exactly m * 10^e or m / 10^e in single precision, one
+// correctly rounded operation, so it matches strtof; other spellings are
+// handed to strtof. The range has to be followed by a character that cannot
+// continue a number (markup, whitespace or a NUL), as in the scene files.
+class NumberScanner {
+public:
+  NumberScanner(const char *begin, const char *end)
+      : cursor(begin), end(end) {}
+
+  const char *position() const { return cursor; }
+
+  bool next(float &value) {
+    if (!skip_space()) {
+      return false;
+    }
+    const char *c = cursor;
+    const bool negative = *c == '-';
+    if (*c == '-' || *c == '+') {
+      ++c;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0; // significant digits in mantissa
+    int exponent = 0;
+    bool any_digit = false;
+    bool exact = true;
+    for (; c < end && is_digit(*c); ++c) {
+      any_digit = true;
+      accumulate(*c, mantissa, digits, exponent, exact, false);
+    }
+    if (c < end && *c == '.') {
+      for (++c; c < end && is_digit(*c); ++c) {
+        any_digit = true;
+        accumulate(*c, mantissa, digits, exponent, exact, true);
+      }
+    }
+    if (!any_digit) {
+      return slow_float(value);
+    }
+    if (c < end && (*c == 'e' || *c == 'E')) {
+      const char *e = c + 1;
+      const bool negative_exponent = e < end && *e == '-';
+      if (e < end && (*e == '-' || *e == '+')) {
+        ++e;
+      }
+      if (e == end || !is_digit(*e)) {
+        return slow_float(value);
+      }
+      int written = 0;
+      for (; e < end && is_digit(*e); ++e) {
+        written = written < 10000 ? written * 10 + (*e - '0') : written;
+      }
+      exponent += negative_exponent ? -written : written;
+      c = e;
+    }
+    if (c < end && (*c == 'x' || *c == 'X' || *c == 'n' || *c == 'N' ||
+                    *c == 'i' || *c == 'I' || *c == 'p' || *c == 'P')) {
+      return slow_float(value);
+    }
+    if (!exact || mantissa > (1u << 24) || exponent < -10 || exponent > 10) {
+      return slow_float(value);
+    }
+    static const float POWERS[11] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                     1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+    float result = (float)mantissa;
+    result = exponent < 0 ? result / POWERS[-exponent]
+                          : result * POWERS[exponent];
+    value = negative ? -result : result;
+    cursor = c;
+    return true;
+  }
+
+  bool next(int &value) {
+    if (!skip_space()) {
+      return false;
+    }
+    const char *c = cursor;
+    const bool negative = *c == '-';
+    if (*c == '-' || *c == '+') {
+      ++c;
+    }
+    const char *digits = c;
+    long result = 0;
+    for (; c < end && is_digit(*c); ++c) {
+      result = result * 10 + (*c - '0');
+    }
+    if (c == digits) {
+      return false;
+    }
+    value = negative ? -result : result;
+    cursor = c;
+    return true;
+  }
+
+private:
+  static bool is_digit(char c) { return (unsigned char)(c - '0') < 10; }
+  static bool is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+  }
+
+  // digits past the 19th cannot be held, the value goes to strtof then
+  static void accumulate(char digit, uint64_t &mantissa, int &digits,
+                         int &exponent, bool &exact, bool fraction) {
+    if (mantissa == 0 && digit == '0') {
+      exponent -= fraction;
+      return;
+    }
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (digit - '0');
+      ++digits;
+      exponent -= fraction;
+    } else {
+      exact = false;
+    }
+  }
+
+  // whitespace runs are mostly a single separator, longer ones (the
+  // indentation between lines) are skipped 16 bytes at a time
+  bool skip_space() {
+    if (cursor < end && !is_space(*cursor)) {
+      return true;
+    }
+    while (cursor + 16 <= end) {
+      const __m128i chunk = _mm_loadu_si128((const __m128i *)cursor);
+      const __m128i space = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                       _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))),
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')),
+                       _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+      const int other = ~_mm_movemask_epi8(space) & 0xffff;
+      if (other) {
+        cursor += __builtin_ctz(other);
+        return true;
+      }
+      cursor += 16;
+    }
+    while (cursor < end && is_space(*cursor)) {
+      ++cursor;
+    }
+    return cursor < end;
+  }
+
+  bool slow_float(float &value) {
+    char *last;
+    value = std::strtof(cursor, &last);
+    if (last == cursor || last > end) {
+      return false;
+    }
+    cursor = last;
+    return true;
+  }
+
+  const char *cursor;
+  const char *end;
+};
+
+#endif // NUMBER_SCANNER_H
@@ -0,0 +1,464 @@
+#include "paged_geometry.h"
+#include "mesh_import.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <cerrno>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+// primitives per chunk, leaves are never split so a chunk may hold a few
+// more; 2048 primitives are 96 KB of lanes
+const int CHUNK_PRIMITIVES = 2048;
+// chunks filled in parallel before being written out
+const int CHUNKS_PER_BATCH = 64;
+// spilled faces and mesh file vertices written at once, 768 KB each
+const size_t FACE_BATCH = 1 << 14;
+const size_t VERTEX_BATCH = 1 << 16;
+
+std::atomic<uint64_t> next_geometry_id(1);
+
+size_t chunk_bytes(int count) {
+  return (size_t)CHUNK_LANES * (count + parser::TRIANGLE_SOA_PADDING) *
+         sizeof(float);
+}
+
+// first primitive and primitive count of every leaf, in primitive order
+std::vector<std::pair<int, int> > collect_leaves(const parser::Scene &scene) {
+  std::vector<std::pair<int, int> > leaves;
+  for (int n = 0; n < scene.bvh_node_count; ++n) {
+    const parser::WideBVHNode &node = scene.bvh_node_array[n];
+    for (int c = 0; c < parser::BVH_WIDTH; ++c) {
+      if (node.prim_count[c] > 0) {
+        leaves.push_back(std::make_pair(node.child[c], node.prim_count[c]));
+      }
+    }
+  }
+  std::sort(leaves.begin(), leaves.end());
+  return leaves;
+}
+
+// an unlinked file in TMPDIR, it goes away with the descriptor
+int scratch_file(const char *name) {
+  const char *directory = std::getenv("TMPDIR");
+  std::string path = std::string(directory && *directory ? directory : "/tmp") +
+                     "/raytracer-" + name + "-XXXXXX";
+  const int fd = mkstemp(&path[0]);
+  if (fd < 0) {
+    throw std::runtime_error("Error: " + path + " cannot be created.");
+  }
+  unlink(path.c_str());
+  return fd;
+}
+
+void write_all(int fd, const char *data, size_t size, const char *what) {
+  while (size > 0) {
+    const ssize_t written = write(fd, data, size);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      throw std::runtime_error(std::string("Error: ") + what +
+                               " cannot be written.");
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+void grow(FaceBounds &b, const parser::Vec3f &p) {
+  b.box_min = {std::min(b.box_min.x, p.x), std::min(b.box_min.y, p.y),
+               std::min(b.box_min.z, p.z)};
+  b.box_max = {std::max(b.box_max.x, p.x), std::max(b.box_max.y, p.y),
+               std::max(b.box_max.z, p.z)};
+}
+
+// The vertices of a mesh file go to a scratch file of their own as they are
+// read and faces are spilled as soon as their vertices are known, through a
+// mapping of that file. Faces keep their order: once one has to wait for a
+// vertex further down the file, all later ones wait for the end of it.
+class SpillSink : public MeshSink {
+public:
+  explicit SpillSink(SpilledFaces &faces)
+      : faces(faces), fd(scratch_file("vertices")), flushed(0),
+        mapped(NULL), mapped_count(0) {}
+
+  ~SpillSink() {
+    unmap();
+    close(fd);
+  }
+
+  void vertex(const parser::Vec3f &v) {
+    buffer.push_back(v);
+    if (buffer.size() == VERTEX_BATCH) {
+      write_all(fd, (const char *)buffer.data(),
+                buffer.size() * sizeof(parser::Vec3f), "mesh vertices");
+      flushed += buffer.size();
+      buffer.clear();
+    }
+  }
+
+  void triangle(int v0_id, int v1_id, int v2_id) {
+    const size_t count = flushed + buffer.size();
+    if (!waiting.empty() || (size_t)v0_id >= count ||
+        (size_t)v1_id >= count || (size_t)v2_id >= count) {
+      waiting.push_back({v0_id, v1_id, v2_id});
+      return;
+    }
+    faces.add_face(vertex_at(v0_id), vertex_at(v1_id), vertex_at(v2_id));
+  }
+
+  // after the import, which checked the ids against the vertex count
+  void finish() {
+    for (size_t f = 0; f < waiting.size(); ++f) {
+      faces.add_face(vertex_at(waiting[f].x), vertex_at(waiting[f].y),
+                     vertex_at(waiting[f].z));
+    }
+  }
+
+private:
+  SpillSink(const SpillSink &);
+  SpillSink &operator=(const SpillSink &);
+
+  // by value, the next call may map the file again
+  parser::Vec3f vertex_at(size_t id) {
+    if (id >= flushed) {
+      return buffer[id - flushed];
+    }
+    if (id >= mapped_count) {
+      unmap();
+      void *mapping = mmap(NULL, flushed * sizeof(parser::Vec3f), PROT_READ,
+                           MAP_SHARED, fd, 0);
+      if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Error: mesh vertices cannot be mapped.");
+      }
+      mapped = static_cast<const parser::Vec3f *>(mapping);
+      mapped_count = flushed;
+    }
+    return mapped[id];
+  }
+
+  void unmap() {
+    if (mapped) {
+      munmap(const_cast<parser::Vec3f *>(mapped),
+             mapped_count * sizeof(parser::Vec3f));
+      mapped = NULL;
+    }
+  }
+
+  SpilledFaces &faces;
+  int fd;
+  std::vector<parser::Vec3f> buffer; // vertices after the flushed ones
+  size_t flushed;
+  const parser::Vec3f *mapped;
+  size_t mapped_count;
+  std::vector<parser::Vec3i> waiting;
+};
+
+// straight from the vertices and faces, the same lanes buildTriangleSoA
+// computes, so a paged render never needs the whole triangle_soa
+void fill_chunk(const parser::Scene &scene, GeometryChunk &chunk) {
+  chunk.data.assign(chunk_bytes(chunk.count) / sizeof(float), 0.0f);
+  float *lanes[CHUNK_LANES];
+  for (int k = 0; k < CHUNK_LANES; ++k) {
+    lanes[k] = const_cast<float *>(chunk.lane(k));
+  }
+  for (int i = 0; i < chunk.count; ++i) {
+    const parser::Primitive &primitive = scene.primitives[chunk.first + i];
+    if (primitive.type == parser::SPHERE) {
+      continue;
+    }
+    if (primitive.type == parser::MESH_FACE && scene.spilled_faces) {
+      const float *record = scene.spilled_faces->lanes(primitive.object_id,
+                                                       primitive.face_id);
+      for (int k = 0; k < CHUNK_LANES; ++k) {
+        lanes[k][i] = record[k];
+      }
+      continue;
+    }
+    const parser::Face &face =
+        primitive.type == parser::TRIANGLE
+            ? scene.triangles[primitive.object_id].indices
+            : scene.meshes[primitive.object_id].faces[primitive.face_id];
+    const parser::Vec3f v0 = scene.vertex_data[face.v0_id - 1];
+    const parser::Vec3f edge1 =
+        subtract_vectors(scene.vertex_data[face.v1_id - 1], v0);
+    const parser::Vec3f edge2 =
+        subtract_vectors(scene.vertex_data[face.v2_id - 1], v0);
+    lanes[LANE_V0_X][i] = v0.x;
+    lanes[LANE_V0_Y][i] = v0.y;
+    lanes[LANE_V0_Z][i] = v0.z;
+    lanes[LANE_EDGE1_X][i] = edge1.x;
+    lanes[LANE_EDGE1_Y][i] = edge1.y;
+    lanes[LANE_EDGE1_Z][i] = edge1.z;
+    lanes[LANE_EDGE2_X][i] = edge2.x;
+    lanes[LANE_EDGE2_Y][i] = edge2.y;
+    lanes[LANE_EDGE2_Z][i] = edge2.z;
+    if (primitive.type == parser::MESH_FACE) {
+      lanes[LANE_NORMAL_X][i] = face.normal.x;
+      lanes[LANE_NORMAL_Y][i] = face.normal.y;
+      lanes[LANE_NORMAL_Z][i] = face.normal.z;
+    }
+  }
+}
+
+} // namespace
+
+thread_local PinnedChunks pinned_chunks = {0, NULL, {}, {}};
+
+PagedGeometry::PagedGeometry(ThreadPool &pool, const parser::Scene &scene,
+                             size_t budget_bytes)
+    : fd(-1), budget_bytes(budget_bytes), id(next_geometry_id++),
+      resident_bytes(0) {
+  const std::vector<std::pair<int, int> > leaves = collect_leaves(scene);
+  for (size_t l = 0; l < leaves.size(); ++l) {
+    if (chunk_first.empty() ||
+        leaves[l].first - chunk_first.back() + leaves[l].second >
+            CHUNK_PRIMITIVES) {
+      chunk_first.push_back(leaves[l].first);
+    }
+  }
+  chunk_first.push_back(scene.primitives.size());
+
+  fd = scratch_file("geometry");
+
+  chunk_offset.push_back(0);
+  try {
+    std::vector<GeometryChunk> batch;
+    for (int c = 0; c < chunk_count(); c += CHUNKS_PER_BATCH) {
+      batch.resize(std::min(CHUNKS_PER_BATCH, chunk_count() - c));
+      pool.parallel_for(0, batch.size(), 1, [&](int first, int last) {
+        for (int b = first; b < last; ++b) {
+          batch[b].first = chunk_first[c + b];
+          batch[b].count = chunk_first[c + b + 1] - chunk_first[c + b];
+          fill_chunk(scene, batch[b]);
+        }
+      });
+      for (size_t b = 0; b < batch.size(); ++b) {
+        const size_t bytes = chunk_bytes(batch[b].count);
+        write_all(fd, (const char *)batch[b].data.data(), bytes,
+                  "geometry chunks");
+        chunk_offset.push_back(chunk_offset.back() + bytes);
+      }
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+
+  pthread_mutex_init(&mutex, NULL);
+  entries.resize(chunk_count());
+  counters = {0, 0, 0, 0, 0};
+}
+
+PagedGeometry::~PagedGeometry() {
+  pthread_mutex_destroy(&mutex);
+  close(fd);
+}
+
+std::shared_ptr<const GeometryChunk>
+PagedGeometry::read_chunk(int chunk) const {
+  std::shared_ptr<GeometryChunk> loaded(new GeometryChunk);
+  loaded->first = chunk_first[chunk];
+  loaded->count = chunk_first[chunk + 1] - chunk_first[chunk];
+  const size_t bytes = chunk_offset[chunk + 1] - chunk_offset[chunk];
+  loaded->data.resize(bytes / sizeof(float));
+  char *data = (char *)loaded->data.data();
+  size_t done = 0;
+  while (done < bytes) {
+    const ssize_t read =
+        pread(fd, data + done, bytes - done, chunk_offset[chunk] + done);
+    if (read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (read <= 0) {
+      throw std::runtime_error("Error: geometry chunks cannot be read.");
+    }
+    done += read;
+  }
+  return loaded;
+}
+
+const GeometryChunk *PagedGeometry::pin(int chunk) {
+  PinnedChunks &local = pinned_chunks;
+  if (local.owner != id) {
+    // pins of an earlier geometry are dropped, chunks do not refer to it
+    local.owner = id;
+    local.lookups = register_thread();
+    for (int slot = 0; slot < PINNED_CHUNKS; ++slot) {
+      local.chunk[slot] = -1;
+      local.pinned[slot].reset();
+    }
+  }
+  local.lookups->store(local.lookups->load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+  const int slot = chunk % PINNED_CHUNKS;
+  // the chunk pinned in the slot before is released once the new one is in
+  local.pinned[slot] = fetch(chunk);
+  local.chunk[slot] = chunk;
+  return local.pinned[slot].get();
+}
+
+std::atomic<uint64_t> *PagedGeometry::register_thread() {
+  pthread_mutex_lock(&mutex);
+  thread_lookups.emplace_back();
+  std::atomic<uint64_t> *lookups = &thread_lookups.back().count;
+  pthread_mutex_unlock(&mutex);
+  lookups->store(0, std::memory_order_relaxed);
+  return lookups;
+}
+
+std::shared_ptr<const GeometryChunk> PagedGeometry::fetch(int chunk) {
+  Entry &entry = entries[chunk];
+  pthread_mutex_lock(&mutex);
+  if (entry.chunk) {
+    lru.splice(lru.begin(), lru, entry.position);
+    std::shared_ptr<const GeometryChunk> resident = entry.chunk;
+    pthread_mutex_unlock(&mutex);
+    return resident;
+  }
+  std::shared_ptr<const GeometryChunk> loaded = entry.pinned.lock();
+  if (!loaded) {
+    ++counters.misses;
+    pthread_mutex_unlock(&mutex);
+
+    // other threads keep hitting the cache while this one waits for the
+    // disk
+    loaded = read_chunk(chunk);
+    pthread_mutex_lock(&mutex);
+    counters.bytes_paged += loaded->data.size() * sizeof(float);
+    if (entry.chunk) {
+      // another thread read it meanwhile
+      lru.splice(lru.begin(), lru, entry.position);
+      loaded = entry.chunk;
+      pthread_mutex_unlock(&mutex);
+      return loaded;
+    }
+  }
+  entry.chunk = loaded;
+  entry.pinned = loaded;
+  lru.push_front(chunk);
+  entry.position = lru.begin();
+  resident_bytes += loaded->data.size() * sizeof(float);
+  // the chunk just read stays even if it alone exceeds the budget
+  while (resident_bytes > budget_bytes && lru.size() > 1) {
+    Entry &victim = entries[lru.back()];
+    resident_bytes -= victim.chunk->data.size() * sizeof(float);
+    victim.chunk.reset();
+    lru.pop_back();
+    ++counters.evictions;
+  }
+  counters.peak_resident_bytes =
+      std::max(counters.peak_resident_bytes, resident_bytes);
+  pthread_mutex_unlock(&mutex);
+  return loaded;
+}
+
+PagingStats PagedGeometry::stats() const {
+  pthread_mutex_lock(&mutex);
+  PagingStats result = counters;
+  for (std::list<ThreadLookups>::const_iterator t = thread_lookups.begin();
+       t != thread_lookups.end(); ++t) {
+    result.lookups += t->count.load(std::memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&mutex);
+  return result;
+}
+
+SpilledFaces::SpilledFaces()
+    : fd(scratch_file("faces")), face_first(1, 0), face_total(0),
+      records(NULL) {}
+
+SpilledFaces::~SpilledFaces() {
+  if (records) {
+    munmap(const_cast<float *>(records),
+           face_total * CHUNK_LANES * sizeof(float));
+  }
+  close(fd);
+}
+
+void SpilledFaces::add_mesh_file(const std::string &path, bool ply) {
+  SpillSink sink(*this);
+  if (ply) {
+    import_ply(path, sink);
+  } else {
+    import_obj(path, sink);
+  }
+  sink.finish();
+  face_first.push_back(face_total);
+}
+
+void SpilledFaces::add_mesh(const std::vector<parser::Vec3f> &vertex_data,
+                            const std::vector<int> &ids) {
+  for (size_t i = 0; i + 2 < ids.size(); i += 3) {
+    for (int k = 0; k < 3; ++k) {
+      if (ids[i + k] < 1 || (size_t)ids[i + k] > vertex_data.size()) {
+        throw std::runtime_error(
+            "Error: a mesh uses vertex " + std::to_string(ids[i + k]) +
+            ", out of core only the ones of VertexData are kept.");
+      }
+    }
+    add_face(vertex_data[ids[i] - 1], vertex_data[ids[i + 1] - 1],
+             vertex_data[ids[i + 2] - 1]);
+  }
+  face_first.push_back(face_total);
+}
+
+void SpilledFaces::add_face(const parser::Vec3f &v0, const parser::Vec3f &v1,
+                            const parser::Vec3f &v2) {
+  const float inf = std::numeric_limits<float>::infinity();
+  FaceBounds b = {{inf, inf, inf}, {-inf, -inf, -inf}};
+  grow(b, v0);
+  grow(b, v1);
+  grow(b, v2);
+  face_bounds.push_back(b);
+
+  // the edges and the normal setup_face computes
+  const parser::Vec3f edge1 = subtract_vectors(v1, v0);
+  const parser::Vec3f edge2 = subtract_vectors(v2, v0);
+  const parser::Vec3f normal = calculate_triangle_normal(v0, v1, v2);
+  const float lanes[CHUNK_LANES] = {v0.x,    v0.y,     v0.z,     edge1.x,
+                                    edge1.y, edge1.z,  edge2.x,  edge2.y,
+                                    edge2.z, normal.x, normal.y, normal.z};
+  buffer.insert(buffer.end(), lanes, lanes + CHUNK_LANES);
+  ++face_total;
+  if (buffer.size() >= FACE_BATCH * CHUNK_LANES) {
+    flush();
+  }
+}
+
+void SpilledFaces::flush() {
+  write_all(fd, (const char *)buffer.data(), buffer.size() * sizeof(float),
+            "mesh faces");
+  buffer.clear();
+}
+
+void SpilledFaces::finish() {
+  flush();
+  std::vector<float>().swap(buffer);
+  if (face_total == 0) {
+    return;
+  }
+  void *mapping = mmap(NULL, face_total * CHUNK_LANES * sizeof(float),
+                       PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("Error: mesh faces cannot be mapped.");
+  }
+  records = static_cast<const float *>(mapping);
+}
+
+void page_out_geometry(ThreadPool &pool, parser::Scene &scene,
+                       size_t budget_bytes) {
+  // only there when a scene cache was read or written, the chunks do not
+  // need it
+  scene.triangle_soa = parser::TriangleSoA();
+  scene.paged_geometry.reset(new PagedGeometry(pool, scene, budget_bytes));
+  scene.spilled_faces.reset();
+
+  scene.releaseTriangleData();
+}
@@ -0,0 +1,206 @@
+#ifndef PAGED_GEOMETRY_H
+#define PAGED_GEOMETRY_H
+
+#include "parser.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// a chunk stores these lanes one after the other
+enum ChunkLane {
+  LANE_V0_X,
+  LANE_V0_Y,
+  LANE_V0_Z,
+  LANE_EDGE1_X,
+  LANE_EDGE1_Y,
+  LANE_EDGE1_Z,
+  LANE_EDGE2_X,
+  LANE_EDGE2_Y,
+  LANE_EDGE2_Z,
+  LANE_NORMAL_X,
+  LANE_NORMAL_Y,
+  LANE_NORMAL_Z,
+  CHUNK_LANES
+};
+
+// the triangle lanes of primitives [first, first + count) like TriangleSoA
+// holds them, with the face normals, padded the same way
+struct GeometryChunk {
+  int first;
+  int count;
+  parser::AlignedFloats data;
+
+  const float *lane(int k) const {
+    return data.data() + (size_t)k * (count + parser::TRIANGLE_SOA_PADDING);
+  }
+};
+
+struct PagingStats {
+  uint64_t lookups;
+  uint64_t misses;
+  uint64_t bytes_paged; // read from the chunk file
+  uint64_t evictions;
+  size_t peak_resident_bytes;
+};
+
+// chunks every thread keeps pinned, the last ones it asked for
+const int PINNED_CHUNKS = 8;
+
+// the chunks the thread pins, a slot per chunk index modulo PINNED_CHUNKS
+struct PinnedChunks {
+  uint64_t owner; // id of the geometry they are from, 0 for none
+  std::atomic<uint64_t> *lookups;
+  int chunk[PINNED_CHUNKS];
+  std::shared_ptr<const GeometryChunk> pinned[PINNED_CHUNKS];
+};
+
+extern thread_local PinnedChunks pinned_chunks;
+
+// Out of core storage of the data the leaf kernels read. The leaves of the
+// BVH are grouped in primitive order, which is the order of the tree and so
+// spatially coherent, into chunks of whole leaves that are written to an
+// unlinked temporary file. Leaves read them back through an LRU cache of at
+// most budget bytes. Every thread also pins the last PINNED_CHUNKS chunks
+// it asked for, most leaves find their chunk there without touching
+// anything shared; the mutex is only taken when a thread needs a chunk it
+// does not pin. An evicted chunk is freed once no thread pins it.
+class PagedGeometry {
+public:
+  PagedGeometry(ThreadPool &pool, const parser::Scene &scene,
+                size_t budget_bytes);
+  ~PagedGeometry();
+
+  // chunk holding the primitive, a leaf never spans two chunks
+  int chunk_of(int primitive) const {
+    return std::upper_bound(chunk_first.begin(), chunk_first.end(),
+                            primitive) -
+           chunk_first.begin() - 1;
+  }
+  // valid until the calling thread acquires another chunk
+  const GeometryChunk *acquire(int chunk) {
+    PinnedChunks &local = pinned_chunks;
+    const int slot = chunk % PINNED_CHUNKS;
+    if (local.owner != id || local.chunk[slot] != chunk) {
+      return pin(chunk);
+    }
+    local.lookups->store(local.lookups->load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+    return local.pinned[slot].get();
+  }
+
+  int chunk_count() const { return chunk_first.size() - 1; }
+  uint64_t file_bytes() const { return chunk_offset.back(); }
+  size_t budget() const { return budget_bytes; }
+  PagingStats stats() const;
+
+private:
+  PagedGeometry(const PagedGeometry &);
+  PagedGeometry &operator=(const PagedGeometry &);
+
+  // acquire when the thread does not pin the chunk yet
+  const GeometryChunk *pin(int chunk);
+  std::shared_ptr<const GeometryChunk> read_chunk(int chunk) const;
+  // the chunk from the LRU cache or the file, under the mutex
+  std::shared_ptr<const GeometryChunk> fetch(int chunk);
+  std::atomic<uint64_t> *register_thread();
+
+  struct Entry {
+    std::shared_ptr<const GeometryChunk> chunk; // empty when not resident
+    std::list<int>::iterator position;          // in lru
+    // still alive while a thread pins it after an eviction
+    std::weak_ptr<const GeometryChunk> pinned;
+  };
+
+  // lookups of one thread, only written by it; padded so the counters of
+  // two threads never share a cache line
+  struct ThreadLookups {
+    std::atomic<uint64_t> count;
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  std::vector<int> chunk_first;       // and the primitive count at the end
+  std::vector<uint64_t> chunk_offset; // and the file size at the end
+  int fd;
+  size_t budget_bytes;
+  const uint64_t id; // tells the pins of this geometry from earlier ones
+
+  mutable pthread_mutex_t mutex; // guards everything below
+  std::vector<Entry> entries;
+  std::list<int> lru; // most recently used first
+  size_t resident_bytes;
+  PagingStats counters; // but lookups, counted per thread
+  std::list<ThreadLookups> thread_lookups;
+};
+
+// box of a mesh face, the one buildBVH would compute from its vertices
+struct FaceBounds {
+  parser::Vec3f box_min;
+  parser::Vec3f box_max;
+};
+
+// Mesh faces of a scene loaded out of core. Every face is written to an
+// unlinked temporary file as soon as it is read, as the lanes a chunk holds
+// for it, and only its box stays in memory for the BVH build; the vertices
+// and faces of a mesh file are never held whole. Meshes are added in order,
+// the file is mapped once the scene is read and the chunks are made from it.
+class SpilledFaces {
+public:
+  SpilledFaces();
+  ~SpilledFaces();
+
+  // the faces of the next mesh, streamed from a PLY or OBJ file
+  void add_mesh_file(const std::string &path, bool ply);
+  // the faces of the next mesh, from 1-based ids into vertex_data
+  void add_mesh(const std::vector<parser::Vec3f> &vertex_data,
+                const std::vector<int> &ids);
+  // the next face of the mesh being added
+  void add_face(const parser::Vec3f &v0, const parser::Vec3f &v1,
+                const parser::Vec3f &v2);
+  // once every mesh is added, the faces can be read after it
+  void finish();
+
+  int face_count(int mesh) const {
+    return face_first[mesh + 1] - face_first[mesh];
+  }
+  const FaceBounds &bounds(int mesh, int face) const {
+    return face_bounds[face_first[mesh] + face];
+  }
+  // the boxes are only needed until the BVH is built
+  void release_bounds() { std::vector<FaceBounds>().swap(face_bounds); }
+  // CHUNK_LANES floats, in the order of ChunkLane
+  const float *lanes(int mesh, int face) const {
+    return records + (face_first[mesh] + face) * CHUNK_LANES;
+  }
+
+private:
+  SpilledFaces(const SpilledFaces &);
+  SpilledFaces &operator=(const SpilledFaces &);
+
+  void flush();
+
+  int fd;
+  std::vector<size_t> face_first; // of every mesh, and the face count
+  std::vector<FaceBounds> face_bounds;
+  std::vector<float> buffer; // lanes not written yet
+  size_t face_total;
+  const float *records; // the mapped file after finish
+};
+
+// Moves the triangle data of the scene out of core: the chunks are written
+// from the vertices and faces, or from spilled_faces which is dropped then,
+// and the faces of every mesh are released and vertex_data is reduced to
+// the sphere centers. triangle_soa is freed first and does not have to be
+// built. The BVH has to be built and any cache written before, they need
+// the full geometry.
+void page_out_geometry(ThreadPool &pool, parser::Scene &scene,
+                       size_t budget_bytes);
+
+#endif // PAGED_GEOMETRY_H
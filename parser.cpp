@@ -1,10 +1,233 @@
 #include "parser.h"
+#include "mapped_file.h"
+#include "mesh_import.h"
+#include "number_scanner.h"
+#include "paged_geometry.h"
+#include "thread_pool.h"
 #include "tinyxml2.h"
 #include "utils.h"
+#include "xml_reader.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include <stdexcept>
 
-void parser::Scene::loadFromXml(const std::string &filepath) {
+namespace {
+
+// the basis the renderer derives from the camera elements
+void setup_camera(parser::Camera &camera) {
+  // HACK
+  camera.plane_center = add_vectors(
+      camera.position, multiply_vector(camera.gaze, camera.near_distance));
+  camera.w = {-camera.gaze.x, -camera.gaze.y, -camera.gaze.z};
+  camera.u = cross_product(camera.up, camera.w);
+  camera.q = add_vectors(
+      camera.plane_center,
+      add_vectors(multiply_vector(camera.u, camera.near_plane.x),
+                  multiply_vector(camera.up, camera.near_plane.w)));
+}
+
+// normal and edges of a face whose 1-based vertex ids are set
+void setup_face(const std::vector<parser::Vec3f> &vertex_data,
+                parser::Face &face) {
+  face.normal = calculate_triangle_normal(vertex_data[face.v0_id - 1],
+                                          vertex_data[face.v1_id - 1],
+                                          vertex_data[face.v2_id - 1]);
+  face.edge1 = subtract_vectors(vertex_data[face.v1_id - 1],
+                                vertex_data[face.v0_id - 1]);
+  face.edge2 = subtract_vectors(vertex_data[face.v2_id - 1],
+                                vertex_data[face.v0_id - 1]);
+}
+
+// blocks are split into chunks of about this size for the pool
+const size_t PARSE_CHUNK_BYTES = 256 * 1024;
+const int FACE_GRAIN = 4096;
+
+bool is_separator(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// every number of a whitespace separated block; large blocks are cut at
+// whitespace and the chunks are scanned on the pool. A serial scan stops at
+// the first token that is not a number, so the chunks after the first one
+// that stopped early are dropped
+template <typename T>
+void scan_block(ThreadPool &pool, const char *begin, const char *end,
+                std::vector<T> &values) {
+  const size_t bytes = end - begin;
+  int chunk_count = 1;
+  if (pool.size() > 1 && bytes >= 2 * PARSE_CHUNK_BYTES) {
+    chunk_count = bytes / PARSE_CHUNK_BYTES;
+  }
+
+  std::vector<const char *> cuts(chunk_count + 1);
+  cuts[0] = begin;
+  cuts[chunk_count] = end;
+  for (int c = 1; c < chunk_count; ++c) {
+    const char *cut = std::max(begin + bytes * c / chunk_count, cuts[c - 1]);
+    while (cut < end && !is_separator(*cut)) {
+      ++cut;
+    }
+    cuts[c] = cut;
+  }
+
+  std::vector<std::vector<T> > parts(chunk_count);
+  std::vector<char> complete(chunk_count);
+  pool.parallel_for(0, chunk_count, 1, [&](int c, int) {
+    NumberScanner numbers(cuts[c], cuts[c + 1]);
+    T value;
+    while (numbers.next(value)) {
+      parts[c].push_back(value);
+    }
+    complete[c] = numbers.position() == cuts[c + 1];
+  });
+
+  values.clear();
+  for (int c = 0; c < chunk_count; ++c) {
+    values.insert(values.end(), parts[c].begin(), parts[c].end());
+    if (!complete[c]) {
+      break;
+    }
+  }
+}
+
+void scan_vertices(ThreadPool &pool, const char *begin, const char *end,
+                   std::vector<parser::Vec3f> &vertex_data) {
+  std::vector<float> values;
+  scan_block(pool, begin, end, values);
+  vertex_data.resize(values.size() / 3);
+  for (size_t v = 0; v < vertex_data.size(); ++v) {
+    vertex_data[v] = {values[3 * v], values[3 * v + 1], values[3 * v + 2]};
+  }
+}
+
+void scan_faces(ThreadPool &pool, const char *begin, const char *end,
+                const std::vector<parser::Vec3f> &vertex_data,
+                std::vector<parser::Face> &faces) {
+  std::vector<int> ids;
+  scan_block(pool, begin, end, ids);
+  faces.resize(ids.size() / 3);
+  pool.parallel_for(0, faces.size(), FACE_GRAIN, [&](int first, int last) {
+    for (int f = first; f < last; ++f) {
+      faces[f].v0_id = ids[3 * f];
+      faces[f].v1_id = ids[3 * f + 1];
+      faces[f].v2_id = ids[3 * f + 2];
+      setup_face(vertex_data, faces[f]);
+    }
+  });
+}
+
+// a mesh whose <Faces> names a PLY or OBJ file, relative to the scene file
+struct MeshFile {
+  std::string path;
+  bool ply;
+};
+
+bool mesh_file(const std::string &scene_path, const char *ply_file,
+               const char *obj_file, MeshFile &file) {
+  if (ply_file == NULL && obj_file == NULL) {
+    return false;
+  }
+  file.path = ply_file != NULL ? ply_file : obj_file;
+  file.ply = ply_file != NULL;
+  const size_t slash = scene_path.find_last_of('/');
+  if (file.path[0] != '/' && slash != std::string::npos) {
+    file.path = scene_path.substr(0, slash + 1) + file.path;
+  }
+  return true;
+}
+
+// the vertices of the file go after the ones already read
+void import_faces(ThreadPool &pool, const MeshFile &file,
+                  std::vector<parser::Vec3f> &vertex_data,
+                  std::vector<parser::Face> &faces) {
+  if (file.ply) {
+    import_ply(file.path, vertex_data, faces);
+  } else {
+    import_obj(file.path, vertex_data, faces);
+  }
+  pool.parallel_for(0, faces.size(), FACE_GRAIN, [&](int first, int last) {
+    for (int f = first; f < last; ++f) {
+      setup_face(vertex_data, faces[f]);
+    }
+  });
+}
+
+// the faces of a mesh from its file, or its text when file is NULL; with a
+// spill they go there and faces stays empty
+void read_faces(ThreadPool &pool, const MeshFile *file, const TextSpan &text,
+                SpilledFaces *spill, std::vector<parser::Vec3f> &vertex_data,
+                std::vector<parser::Face> &faces) {
+  if (spill == NULL && file != NULL) {
+    import_faces(pool, *file, vertex_data, faces);
+  } else if (spill == NULL) {
+    scan_faces(pool, text.begin, text.end, vertex_data, faces);
+  } else if (file != NULL) {
+    spill->add_mesh_file(file->path, file->ply);
+  } else {
+    std::vector<int> ids;
+    scan_block(pool, text.begin, text.end, ids);
+    spill->add_mesh(vertex_data, ids);
+  }
+}
+
+// the vertices of mesh files are not kept when the faces are spilled, the
+// triangles and spheres can only use the ones of VertexData then
+void check_scene_vertex(const std::vector<parser::Vec3f> &vertex_data,
+                        int id) {
+  if (id < 1 || (size_t)id > vertex_data.size()) {
+    throw std::runtime_error(
+        "Error: an object uses vertex " + std::to_string(id) +
+        ", out of core only the ones of VertexData are kept.");
+  }
+}
+
+// the text of an element, empty when it has none
+TextSpan element_text(const tinyxml2::XMLElement *element) {
+  const char *text = element->GetText();
+  if (text == NULL) {
+    text = "";
+  }
+  const TextSpan span = {text, text + std::strlen(text)};
+  return span;
+}
+
+void scan(XmlReader &reader, float *values, int count) {
+  const TextSpan text = reader.element_text();
+  NumberScanner numbers(text.begin, text.end);
+  for (int i = 0; i < count; ++i) {
+    if (!numbers.next(values[i])) {
+      throw std::runtime_error("Error: " + reader.name().str() +
+                               " needs " + std::to_string(count) +
+                               " numbers.");
+    }
+  }
+}
+
+void scan(XmlReader &reader, int *values, int count) {
+  const TextSpan text = reader.element_text();
+  NumberScanner numbers(text.begin, text.end);
+  for (int i = 0; i < count; ++i) {
+    if (!numbers.next(values[i])) {
+      throw std::runtime_error("Error: " + reader.name().str() +
+                               " needs " + std::to_string(count) +
+                               " numbers.");
+    }
+  }
+}
+
+void scan(XmlReader &reader, parser::Vec3f &value) {
+  float values[3];
+  scan(reader, values, 3);
+  value = {values[0], values[1], values[2]};
+}
+
+} // namespace
+
+void parser::Scene::loadFromXml(const std::string &filepath,
+                                 ThreadPool &pool) {
   tinyxml2::XMLDocument file;
   std::stringstream stream;
 
@@ -73,15 +296,7 @@ void parser::Scene::loadFromXml(const std::string &filepath) {
     stream >> camera.image_width >> camera.image_height;
     stream >> camera.image_name;
 
-    // HACK
-    camera.plane_center = add_vectors(
-        camera.position, multiply_vector(camera.gaze, camera.near_distance));
-    camera.w = {-camera.gaze.x, -camera.gaze.y, -camera.gaze.z};
-    camera.u = cross_product(camera.up, camera.w);
-    camera.q = add_vectors(
-        camera.plane_center,
-        add_vectors(multiply_vector(camera.u, camera.near_plane.x),
-                    multiply_vector(camera.up, camera.near_plane.w)));
+    setup_camera(camera);
 
     cameras.push_back(camera);
     element = element->NextSiblingElement("Camera");
@@ -139,13 +354,8 @@ void parser::Scene::loadFromXml(const std::string &filepath) {
 
   // Get VertexData
   element = root->FirstChildElement("VertexData");
-  stream << element->GetText() << std::endl;
-  Vec3f vertex;
-  while (!(stream >> vertex.x).eof()) {
-    stream >> vertex.y >> vertex.z;
-    vertex_data.push_back(vertex);
-  }
-  stream.clear();
+  TextSpan text = element_text(element);
+  scan_vertices(pool, text.begin, text.end, vertex_data);
 
   // Get Meshes
   element = root->FirstChildElement("Objects");
@@ -157,18 +367,14 @@ void parser::Scene::loadFromXml(const std::string &filepath) {
     stream >> mesh.material_id;
 
     child = element->FirstChildElement("Faces");
-    stream << child->GetText() << std::endl;
-    Face face;
-    while (!(stream >> face.v0_id).eof()) {
-      stream >> face.v1_id >> face.v2_id;
-      face.normal = calculate_triangle_normal(vertex_data[face.v0_id - 1],
-                                              vertex_data[face.v1_id - 1],
-                                              vertex_data[face.v2_id - 1]);
-      face.edge1 = subtract_vectors(vertex_data[face.v1_id - 1],vertex_data[face.v0_id - 1]);
-      face.edge2 = subtract_vectors(vertex_data[face.v2_id - 1],vertex_data[face.v0_id - 1]);
-      mesh.faces.push_back(face);
+    MeshFile file;
+    const bool external = mesh_file(filepath, child->Attribute("plyFile"),
+                                    child->Attribute("objFile"), file);
+    if (external) {
+      mesh_files.push_back(file.path);
     }
-    stream.clear();
+    read_faces(pool, external ? &file : NULL, element_text(child),
+               spilled_faces.get(), vertex_data, mesh.faces);
 
     meshes.push_back(mesh);
     mesh.faces.clear();
@@ -189,6 +395,11 @@ void parser::Scene::loadFromXml(const std::string &filepath) {
     stream << child->GetText() << std::endl;
     stream >> triangle.indices.v0_id >> triangle.indices.v1_id >>
         triangle.indices.v2_id;
+    if (spilled_faces) {
+      check_scene_vertex(vertex_data, triangle.indices.v0_id);
+      check_scene_vertex(vertex_data, triangle.indices.v1_id);
+      check_scene_vertex(vertex_data, triangle.indices.v2_id);
+    }
 
     triangle.normal =
         calculate_triangle_normal(vertex_data[triangle.indices.v0_id - 1],
@@ -224,4 +435,289 @@ void parser::Scene::loadFromXml(const std::string &filepath) {
     spheres.push_back(sphere);
     element = element->NextSiblingElement("Sphere");
   }
+
+  if (spilled_faces) {
+    for (size_t s = 0; s < spheres.size(); ++s) {
+      check_scene_vertex(vertex_data, spheres[s].center_vertex_id);
+    }
+    spilled_faces->finish();
+  }
+}
+
+// Same result as loadFromXml without tinyxml2: the file is mapped and read
+// once with a pull parser, numbers are converted in place and the face
+// lists, which need the vertices, are kept as spans into the mapping until
+// the whole document is read.
+void parser::Scene::loadFromXmlMapped(const std::string &filepath,
+                                       ThreadPool &pool) {
+  const MappedFile file(filepath);
+  XmlReader reader(file.data(), file.data() + file.size());
+
+  XmlReader::Event event = reader.next();
+  while (event == XmlReader::TEXT) {
+    event = reader.next();
+  }
+  if (event != XmlReader::START) {
+    throw std::runtime_error("Error: Root is not found.");
+  }
+
+  background_color = {0, 0, 0};
+  shadow_ray_epsilon = 0.001f;
+  max_recursion_depth = 0;
+
+  // only the first element of each kind counts, like FirstChildElement
+  bool seen_background = false, seen_epsilon = false, seen_depth = false;
+  bool seen_cameras = false, seen_lights = false, seen_materials = false;
+  bool seen_vertices = false, seen_objects = false;
+  TextSpan vertex_text = {NULL, NULL};
+  // faces are read once the vertices are known, from the document or
+  // from a mesh file
+  struct MeshSource {
+    TextSpan text;
+    bool external;
+    MeshFile file;
+  };
+  std::vector<MeshSource> mesh_sources;
+
+  while ((event = reader.next()) != XmlReader::END) {
+    if (event == XmlReader::DONE) {
+      throw std::runtime_error("Error: malformed xml, unexpected end of "
+                               "document");
+    }
+    if (event != XmlReader::START) {
+      continue;
+    }
+    const TextSpan name = reader.name();
+
+    if (name == "BackgroundColor" && !seen_background) {
+      seen_background = true;
+      int color[3];
+      scan(reader, color, 3);
+      background_color = {color[0], color[1], color[2]};
+    } else if (name == "ShadowRayEpsilon" && !seen_epsilon) {
+      seen_epsilon = true;
+      scan(reader, &shadow_ray_epsilon, 1);
+    } else if (name == "MaxRecursionDepth" && !seen_depth) {
+      seen_depth = true;
+      scan(reader, &max_recursion_depth, 1);
+    } else if (name == "Cameras" && !seen_cameras) {
+      seen_cameras = true;
+      while ((event = reader.next()) != XmlReader::END) {
+        if (event != XmlReader::START) {
+          continue;
+        }
+        if (reader.name() != "Camera") {
+          reader.skip_element();
+          continue;
+        }
+        Camera camera;
+        while ((event = reader.next()) != XmlReader::END) {
+          if (event != XmlReader::START) {
+            continue;
+          }
+          const TextSpan child = reader.name();
+          if (child == "Position") {
+            scan(reader, camera.position);
+          } else if (child == "Gaze") {
+            scan(reader, camera.gaze);
+          } else if (child == "Up") {
+            scan(reader, camera.up);
+          } else if (child == "NearPlane") {
+            scan(reader, &camera.near_plane.x, 4);
+          } else if (child == "NearDistance") {
+            scan(reader, &camera.near_distance, 1);
+          } else if (child == "ImageResolution") {
+            int resolution[2];
+            scan(reader, resolution, 2);
+            camera.image_width = resolution[0];
+            camera.image_height = resolution[1];
+          } else if (child == "ImageName") {
+            // the first whitespace separated word, as operator>> reads it
+            const TextSpan text = reader.element_text();
+            const char *first = text.begin;
+            while (first < text.end && isspace((unsigned char)*first)) {
+              ++first;
+            }
+            const char *last = first;
+            while (last < text.end && !isspace((unsigned char)*last)) {
+              ++last;
+            }
+            camera.image_name.assign(first, last);
+          } else {
+            reader.skip_element();
+          }
+        }
+        setup_camera(camera);
+        cameras.push_back(camera);
+      }
+    } else if (name == "Lights" && !seen_lights) {
+      seen_lights = true;
+      while ((event = reader.next()) != XmlReader::END) {
+        if (event != XmlReader::START) {
+          continue;
+        }
+        if (reader.name() == "AmbientLight") {
+          scan(reader, ambient_light);
+        } else if (reader.name() == "PointLight") {
+          PointLight point_light;
+          while ((event = reader.next()) != XmlReader::END) {
+            if (event != XmlReader::START) {
+              continue;
+            }
+            if (reader.name() == "Position") {
+              scan(reader, point_light.position);
+            } else if (reader.name() == "Intensity") {
+              scan(reader, point_light.intensity);
+            } else {
+              reader.skip_element();
+            }
+          }
+          point_lights.push_back(point_light);
+        } else {
+          reader.skip_element();
+        }
+      }
+    } else if (name == "Materials" && !seen_materials) {
+      seen_materials = true;
+      while ((event = reader.next()) != XmlReader::END) {
+        if (event != XmlReader::START) {
+          continue;
+        }
+        if (reader.name() != "Material") {
+          reader.skip_element();
+          continue;
+        }
+        Material material;
+        TextSpan type;
+        material.is_mirror = reader.attribute("type", type) && type == "mirror";
+        while ((event = reader.next()) != XmlReader::END) {
+          if (event != XmlReader::START) {
+            continue;
+          }
+          const TextSpan child = reader.name();
+          if (child == "AmbientReflectance") {
+            scan(reader, material.ambient);
+          } else if (child == "DiffuseReflectance") {
+            scan(reader, material.diffuse);
+          } else if (child == "SpecularReflectance") {
+            scan(reader, material.specular);
+          } else if (child == "MirrorReflectance") {
+            scan(reader, material.mirror);
+          } else if (child == "PhongExponent") {
+            scan(reader, &material.phong_exponent, 1);
+          } else {
+            reader.skip_element();
+          }
+        }
+        materials.push_back(material);
+      }
+    } else if (name == "VertexData" && !seen_vertices) {
+      seen_vertices = true;
+      vertex_text = reader.element_text();
+    } else if (name == "Objects" && !seen_objects) {
+      seen_objects = true;
+      while ((event = reader.next()) != XmlReader::END) {
+        if (event != XmlReader::START) {
+          continue;
+        }
+        const TextSpan object = reader.name();
+        if (object == "Mesh") {
+          Mesh mesh;
+          MeshSource source = {{NULL, NULL}, false, MeshFile()};
+          while ((event = reader.next()) != XmlReader::END) {
+            if (event != XmlReader::START) {
+              continue;
+            }
+            if (reader.name() == "Material") {
+              scan(reader, &mesh.material_id, 1);
+            } else if (reader.name() == "Faces") {
+              TextSpan ply_file, obj_file;
+              const bool has_ply = reader.attribute("plyFile", ply_file);
+              const bool has_obj = reader.attribute("objFile", obj_file);
+              source.external =
+                  mesh_file(filepath, has_ply ? ply_file.str().c_str() : NULL,
+                            has_obj ? obj_file.str().c_str() : NULL,
+                            source.file);
+              source.text = reader.element_text();
+            } else {
+              reader.skip_element();
+            }
+          }
+          meshes.push_back(mesh);
+          mesh_sources.push_back(source);
+        } else if (object == "Triangle") {
+          Triangle triangle;
+          while ((event = reader.next()) != XmlReader::END) {
+            if (event != XmlReader::START) {
+              continue;
+            }
+            if (reader.name() == "Material") {
+              scan(reader, &triangle.material_id, 1);
+            } else if (reader.name() == "Indices") {
+              int indices[3];
+              scan(reader, indices, 3);
+              triangle.indices.v0_id = indices[0];
+              triangle.indices.v1_id = indices[1];
+              triangle.indices.v2_id = indices[2];
+            } else {
+              reader.skip_element();
+            }
+          }
+          triangles.push_back(triangle);
+        } else if (object == "Sphere") {
+          Sphere sphere;
+          while ((event = reader.next()) != XmlReader::END) {
+            if (event != XmlReader::START) {
+              continue;
+            }
+            if (reader.name() == "Material") {
+              scan(reader, &sphere.material_id, 1);
+            } else if (reader.name() == "Center") {
+              scan(reader, &sphere.center_vertex_id, 1);
+            } else if (reader.name() == "Radius") {
+              scan(reader, &sphere.radius, 1);
+            } else {
+              reader.skip_element();
+            }
+          }
+          spheres.push_back(sphere);
+        } else {
+          reader.skip_element();
+        }
+      }
+    } else {
+      reader.skip_element();
+    }
+  }
+
+  scan_vertices(pool, vertex_text.begin, vertex_text.end, vertex_data);
+  for (size_t m = 0; m < meshes.size(); ++m) {
+    const MeshSource &source = mesh_sources[m];
+    if (source.external) {
+      mesh_files.push_back(source.file.path);
+    }
+    read_faces(pool, source.external ? &source.file : NULL, source.text,
+               spilled_faces.get(), vertex_data, meshes[m].faces);
+  }
+
+  for (size_t t = 0; t < triangles.size(); ++t) {
+    Triangle &triangle = triangles[t];
+    Face face = triangle.indices;
+    if (spilled_faces) {
+      check_scene_vertex(vertex_data, face.v0_id);
+      check_scene_vertex(vertex_data, face.v1_id);
+      check_scene_vertex(vertex_data, face.v2_id);
+    }
+    setup_face(vertex_data, face);
+    triangle.normal = face.normal;
+    triangle.edge1 = face.edge1;
+    triangle.edge2 = face.edge2;
+  }
+
+  if (spilled_faces) {
+    for (size_t s = 0; s < spheres.size(); ++s) {
+      check_scene_vertex(vertex_data, spheres[s].center_vertex_id);
+    }
+    spilled_faces->finish();
+  }
 }
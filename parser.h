@@ -1,9 +1,17 @@
 #ifndef __HW1__PARSER__
 #define __HW1__PARSER__
 
+#include "aligned_allocator.h"
+#include <memory>
 #include <string>
 #include <vector>
 
+class CompactGeometry;
+class MappedFile;
+class PagedGeometry;
+class SpilledFaces;
+class ThreadPool;
+
 namespace parser {
 struct Vec3f {
   float x, y, z;
@@ -73,6 +81,41 @@ struct Sphere {
   float radius;
 };
 
+enum PrimitiveType { SPHERE, TRIANGLE, MESH_FACE };
+
+struct Primitive {
+  PrimitiveType type;
+  int object_id; // index into spheres, triangles or meshes
+  int face_id;   // index into Mesh::faces, only used by MESH_FACE
+};
+
+const int BVH_WIDTH = 8;
+const int BVH_MAX_DEPTH = 60;
+
+// binary trees are collapsed into nodes with up to BVH_WIDTH children whose
+// boxes are stored component-wise so all of them are tested at once
+struct WideBVHNode {
+  float bounds[6][BVH_WIDTH]; // min x, max x, min y, max y, min z, max z
+  int child[BVH_WIDTH];       // node for inner children, first primitive
+                              // for leaves
+  int prim_count[BVH_WIDTH];  // 0 for inner children
+};
+
+typedef std::vector<float, AlignedAllocator<float, 32> > AlignedFloats;
+
+// extra lanes at the end so kernels can load a full vector at any primitive
+const int TRIANGLE_SOA_PADDING = 16;
+
+// triangle data in primitive order so a leaf reads consecutive lanes, sphere
+// lanes hold a degenerate triangle that is never hit
+struct TriangleSoA {
+  AlignedFloats v0_x, v0_y, v0_z;
+  AlignedFloats edge1_x, edge1_y, edge1_z;
+  AlignedFloats edge2_x, edge2_y, edge2_z;
+};
+
+enum BVHBuilder { SAH_BUILDER, LBVH_BUILDER };
+
 struct Scene {
   // Data
   Vec3i background_color;
@@ -86,9 +129,41 @@ struct Scene {
   std::vector<Mesh> meshes;
   std::vector<Triangle> triangles;
   std::vector<Sphere> spheres;
+  // PLY and OBJ files the meshes were imported from, as they were opened
+  std::vector<std::string> mesh_files;
+  // set before loading to read the mesh faces out of core: they go to disk
+  // as they are read and the meshes keep none, buildBVH takes their boxes
+  // and the paged geometry their lanes from here
+  std::shared_ptr<SpilledFaces> spilled_faces;
+
+  // Acceleration structure
+  std::vector<Primitive> primitives;
+  std::vector<WideBVHNode, AlignedAllocator<WideBVHNode, 64> > bvh_nodes;
+  // the nodes traversal reads, bvh_nodes or the mapping of a BVH cache
+  const WideBVHNode *bvh_node_array = NULL;
+  int bvh_node_count = 0;
+  std::shared_ptr<const MappedFile> bvh_mapping;
+  TriangleSoA triangle_soa;
+  // set when the geometry is out of core, triangle_soa and the mesh faces
+  // are empty then and leaves read their chunk instead
+  std::shared_ptr<PagedGeometry> paged_geometry;
+  // set when the geometry is compressed, triangle_soa and the mesh faces are
+  // empty then and leaves are decoded when they are tested
+  std::shared_ptr<const CompactGeometry> compact_geometry;
 
   // Functions
-  void loadFromXml(const std::string &filepath);
+  // large vertex and face blocks are parsed in chunks on the pool
+  void loadFromXml(const std::string &filepath, ThreadPool &pool);
+  // same scene, read from a memory mapping without building a DOM
+  void loadFromXmlMapped(const std::string &filepath, ThreadPool &pool);
+  // orders primitives and builds the nodes, triangle_soa is not built since
+  // paged and compact geometry are made from the faces directly
+  void buildBVH(ThreadPool &pool, BVHBuilder builder);
+  // triangle_soa for the current order of primitives
+  void buildTriangleSoA(ThreadPool &pool);
+  // frees triangle_soa, the mesh faces and every vertex but the sphere
+  // centers, once the leaves read their geometry from somewhere else
+  void releaseTriangleData();
 };
 } // namespace parser
 
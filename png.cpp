@@ -0,0 +1,386 @@
+#include "png.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+// strips smaller than this compress noticeably worse, every strip starts
+// with an empty LZ77 window
+const size_t STRIP_BYTES = 1 << 18;
+
+const int WINDOW_SIZE = 1 << 15;
+const int HASH_BITS = 15;
+const int MAX_CHAIN = 64;
+const int MIN_MATCH = 3;
+const int MAX_MATCH = 258;
+
+const int LENGTH_BASE[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                             15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                             67, 83, 99, 115, 131, 163, 195, 227, 258};
+const int LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                              2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int DISTANCE_BASE[30] = {1,    2,    3,    4,    5,    7,     9,
+                               13,   17,   25,   33,   49,   65,    97,
+                               129,  193,  257,  385,  513,  769,   1025,
+                               1537, 2049, 3073, 4097, 6145, 8193,  12289,
+                               16385, 24577};
+const int DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5, 5, 6,
+                                6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// deflate streams are filled from the least significant bit of each byte
+class BitWriter {
+public:
+  explicit BitWriter(std::vector<unsigned char> &out)
+      : out(out), bits(0), count(0) {}
+
+  void put(uint32_t value, int n) {
+    bits |= (uint64_t)value << count;
+    count += n;
+    while (count >= 8) {
+      out.push_back(bits & 0xff);
+      bits >>= 8;
+      count -= 8;
+    }
+  }
+
+  // Huffman codes are packed starting from their most significant bit
+  void put_code(uint32_t code, int n) {
+    uint32_t reversed = 0;
+    for (int b = 0; b < n; ++b) {
+      reversed = (reversed << 1) | ((code >> b) & 1);
+    }
+    put(reversed, n);
+  }
+
+  void align() {
+    if (count > 0) {
+      out.push_back(bits & 0xff);
+      bits = 0;
+      count = 0;
+    }
+  }
+
+private:
+  std::vector<unsigned char> &out;
+  uint64_t bits;
+  int count;
+};
+
+// the fixed literal/length code of RFC 1951 3.2.6
+void put_literal(BitWriter &writer, int symbol) {
+  if (symbol < 144) {
+    writer.put_code(0x30 + symbol, 8);
+  } else if (symbol < 256) {
+    writer.put_code(0x190 + symbol - 144, 9);
+  } else if (symbol < 280) {
+    writer.put_code(symbol - 256, 7);
+  } else {
+    writer.put_code(0xc0 + symbol - 280, 8);
+  }
+}
+
+void put_match(BitWriter &writer, int length, int distance) {
+  const int l = std::upper_bound(LENGTH_BASE, LENGTH_BASE + 29, length) -
+                LENGTH_BASE - 1;
+  put_literal(writer, 257 + l);
+  writer.put(length - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+  const int d =
+      std::upper_bound(DISTANCE_BASE, DISTANCE_BASE + 30, distance) -
+      DISTANCE_BASE - 1;
+  writer.put_code(d, 5);
+  writer.put(distance - DISTANCE_BASE[d], DISTANCE_EXTRA[d]);
+}
+
+inline uint32_t hash3(const unsigned char *p) {
+  return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << HASH_BITS) - 1);
+}
+
+// one fixed Huffman block with greedy hash chain matching; a strip that is
+// not the last one is closed with an empty stored block, which leaves the
+// stream on a byte boundary with the final bit clear
+void deflate_strip(const unsigned char *data, int size, bool last,
+                   std::vector<unsigned char> &out) {
+  BitWriter writer(out);
+  writer.put(last ? 1 : 0, 1);
+  writer.put(1, 2);
+
+  std::vector<int> head(1 << HASH_BITS, -1);
+  std::vector<int> previous(WINDOW_SIZE, -1);
+  const auto insert = [&](int position) {
+    const uint32_t h = hash3(data + position);
+    previous[position & (WINDOW_SIZE - 1)] = head[h];
+    head[h] = position;
+  };
+
+  int i = 0;
+  while (i < size) {
+    int best_length = 0;
+    int best_distance = 0;
+    if (i + MIN_MATCH <= size) {
+      const int max_length = std::min(MAX_MATCH, size - i);
+      int candidate = head[hash3(data + i)];
+      for (int chain = 0; chain < MAX_CHAIN && candidate >= 0 &&
+                          i - candidate <= WINDOW_SIZE;
+           ++chain) {
+        int length = 0;
+        while (length < max_length &&
+               data[candidate + length] == data[i + length]) {
+          ++length;
+        }
+        if (length > best_length) {
+          best_length = length;
+          best_distance = i - candidate;
+          if (length == max_length) {
+            break;
+          }
+        }
+        const int next = previous[candidate & (WINDOW_SIZE - 1)];
+        // the slot was reused by a newer position, the chain ends here
+        if (next >= candidate) {
+          break;
+        }
+        candidate = next;
+      }
+      insert(i);
+    }
+
+    if (best_length >= MIN_MATCH) {
+      put_match(writer, best_length, best_distance);
+      for (int k = 1; k < best_length && i + k + MIN_MATCH <= size; ++k) {
+        insert(i + k);
+      }
+      i += best_length;
+    } else {
+      put_literal(writer, data[i]);
+      ++i;
+    }
+  }
+  put_literal(writer, 256);
+
+  if (!last) {
+    writer.put(0, 3);
+    writer.align();
+    const unsigned char empty_stored[4] = {0x00, 0x00, 0xff, 0xff};
+    out.insert(out.end(), empty_stored, empty_stored + 4);
+  } else {
+    writer.align();
+  }
+}
+
+const uint32_t ADLER_BASE = 65521;
+
+uint32_t adler32(const unsigned char *data, size_t size) {
+  uint32_t a = 1, b = 0;
+  while (size > 0) {
+    // the sums cannot overflow within 5552 bytes
+    const size_t n = std::min(size, (size_t)5552);
+    for (size_t i = 0; i < n; ++i) {
+      a += data[i];
+      b += a;
+    }
+    a %= ADLER_BASE;
+    b %= ADLER_BASE;
+    data += n;
+    size -= n;
+  }
+  return (b << 16) | a;
+}
+
+// checksum of the concatenation from the checksums of the two parts, as
+// zlib's adler32_combine
+uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size) {
+  const uint32_t remainder = second_size % ADLER_BASE;
+  uint32_t a = first & 0xffff;
+  uint32_t b = (remainder * a) % ADLER_BASE;
+  a += (second & 0xffff) + ADLER_BASE - 1;
+  b += (first >> 16) + (second >> 16) + ADLER_BASE - remainder;
+  if (a >= ADLER_BASE) {
+    a -= ADLER_BASE;
+  }
+  if (a >= ADLER_BASE) {
+    a -= ADLER_BASE;
+  }
+  if (b >= 2 * ADLER_BASE) {
+    b -= 2 * ADLER_BASE;
+  }
+  if (b >= ADLER_BASE) {
+    b -= ADLER_BASE;
+  }
+  return (b << 16) | a;
+}
+
+struct CrcTable {
+  uint32_t entries[256];
+
+  CrcTable() {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      }
+      entries[n] = c;
+    }
+  }
+};
+
+uint32_t crc32(const unsigned char *data, size_t size) {
+  static const CrcTable table;
+  uint32_t crc = 0xffffffffu;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+inline int paeth(int a, int b, int c) {
+  const int p = a + b - c;
+  const int pa = std::abs(p - a);
+  const int pb = std::abs(p - b);
+  const int pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+// writes the filter type byte and the filtered row, the filter is the one
+// with the smallest sum of absolute differences as suggested by the spec;
+// scratch holds one candidate row per filter type
+void filter_row(const unsigned char *row, const unsigned char *above,
+                int row_bytes, std::vector<unsigned char> &scratch,
+                unsigned char *out) {
+  const int bpp = 3;
+  scratch.resize(5 * (size_t)row_bytes);
+  long best_score = -1;
+  int best = 0;
+  for (int f = 0; f < 5; ++f) {
+    unsigned char *filtered = &scratch[(size_t)f * row_bytes];
+    long score = 0;
+    for (int x = 0; x < row_bytes; ++x) {
+      const int a = x >= bpp ? row[x - bpp] : 0;
+      const int b = above ? above[x] : 0;
+      const int c = above && x >= bpp ? above[x - bpp] : 0;
+      int predictor = 0;
+      switch (f) {
+      case 1:
+        predictor = a;
+        break;
+      case 2:
+        predictor = b;
+        break;
+      case 3:
+        predictor = (a + b) / 2;
+        break;
+      case 4:
+        predictor = paeth(a, b, c);
+        break;
+      }
+      const unsigned char value = row[x] - predictor;
+      filtered[x] = value;
+      score += value < 128 ? value : 256 - value;
+    }
+    if (best_score < 0 || score < best_score) {
+      best_score = score;
+      best = f;
+    }
+  }
+  out[0] = best;
+  std::memcpy(out + 1, &scratch[(size_t)best * row_bytes], row_bytes);
+}
+
+void put_u32(std::vector<unsigned char> &out, uint32_t value) {
+  out.push_back(value >> 24);
+  out.push_back(value >> 16);
+  out.push_back(value >> 8);
+  out.push_back(value);
+}
+
+void put_chunk(std::vector<unsigned char> &png, const char *type,
+               const unsigned char *data, size_t size) {
+  put_u32(png, size);
+  const size_t start = png.size();
+  png.insert(png.end(), type, type + 4);
+  png.insert(png.end(), data, data + size);
+  put_u32(png, crc32(&png[start], png.size() - start));
+}
+
+struct Strip {
+  int first_row, last_row;
+  std::vector<unsigned char> deflated;
+  uint32_t adler;
+  size_t size; // filtered bytes before compression
+};
+
+} // namespace
+
+void encode_png(const unsigned char *pixels, int width, int height,
+                ThreadPool *pool, std::vector<unsigned char> &png) {
+  const int row_bytes = width * 3;
+  const int rows_per_strip =
+      std::max(1, (int)(STRIP_BYTES / (size_t)(row_bytes + 1)));
+  std::vector<Strip> strips((height + rows_per_strip - 1) / rows_per_strip);
+  for (size_t s = 0; s < strips.size(); ++s) {
+    strips[s].first_row = s * rows_per_strip;
+    strips[s].last_row = std::min(height, (int)(s + 1) * rows_per_strip);
+  }
+
+  const auto compress = [&](int first, int last) {
+    std::vector<unsigned char> filtered, scratch;
+    for (int s = first; s < last; ++s) {
+      Strip &strip = strips[s];
+      filtered.resize((size_t)(strip.last_row - strip.first_row) *
+                      (row_bytes + 1));
+      for (int y = strip.first_row; y < strip.last_row; ++y) {
+        const unsigned char *row = pixels + (size_t)y * row_bytes;
+        filter_row(row, y > 0 ? row - row_bytes : NULL, row_bytes, scratch,
+                   &filtered[(size_t)(y - strip.first_row) * (row_bytes + 1)]);
+      }
+      strip.size = filtered.size();
+      strip.adler = adler32(filtered.data(), filtered.size());
+      deflate_strip(filtered.data(), filtered.size(),
+                    s + 1 == (int)strips.size(), strip.deflated);
+    }
+  };
+  if (pool) {
+    pool->parallel_for(0, strips.size(), 1, compress);
+  } else {
+    compress(0, strips.size());
+  }
+
+  png.clear();
+  const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a,
+                                      '\n'};
+  png.insert(png.end(), signature, signature + 8);
+
+  std::vector<unsigned char> header;
+  put_u32(header, width);
+  put_u32(header, height);
+  header.push_back(8); // bit depth
+  header.push_back(2); // truecolor
+  header.push_back(0); // deflate
+  header.push_back(0); // adaptive filtering
+  header.push_back(0); // no interlace
+  put_chunk(png, "IHDR", header.data(), header.size());
+
+  // zlib stream: header for a 32K window, the strips, adler32 of all of them
+  std::vector<unsigned char> stream;
+  stream.push_back(0x78);
+  stream.push_back(0x01);
+  uint32_t adler = 1;
+  for (size_t s = 0; s < strips.size(); ++s) {
+    stream.insert(stream.end(), strips[s].deflated.begin(),
+                  strips[s].deflated.end());
+    adler = adler32_combine(adler, strips[s].adler, strips[s].size);
+  }
+  if (strips.empty()) {
+    // a final empty fixed block
+    const unsigned char empty_block[2] = {0x03, 0x00};
+    stream.insert(stream.end(), empty_block, empty_block + 2);
+  }
+  put_u32(stream, adler);
+  put_chunk(png, "IDAT", stream.data(), stream.size());
+  put_chunk(png, "IEND", NULL, 0);
+}
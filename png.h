@@ -0,0 +1,14 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include <vector>
+
+class ThreadPool;
+
+// Encodes 8-bit RGB pixels as a PNG. The rows are cut into strips that are
+// filtered and deflated independently on the pool, each strip ends with a
+// sync flush so the compressed strips can simply be concatenated.
+void encode_png(const unsigned char *pixels, int width, int height,
+                ThreadPool *pool, std::vector<unsigned char> &png);
+
+#endif // PNG_H
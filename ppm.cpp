@@ -1,7 +1,12 @@
 #include "ppm.h"
 #include <stdexcept>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-void write_ppm(const char* filename, unsigned char* data, int width, int height)
+void write_ppm(const char* filename, unsigned char* data, int width, int height,
+               bool sync)
 {
     FILE *outfile;
 
@@ -35,5 +40,60 @@ void write_ppm(const char* filename, unsigned char* data, int width, int height)
         (void) fprintf(outfile, "\n");
     }
 
+    if (sync && (fflush(outfile) != 0 || fsync(fileno(outfile)) != 0))
+    {
+        (void) fclose(outfile);
+        throw std::runtime_error("Error: The ppm file cannot be synced to disk.");
+    }
+
     (void) fclose(outfile);
 }
+
+void write_ppm_binary(const char* filename, const unsigned char* data,
+                      int width, int height, bool sync)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Error: The ppm file cannot be opened for writing.");
+    }
+
+    char header[64];
+    int header_size = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+
+    iovec parts[2];
+    parts[0].iov_base = header;
+    parts[0].iov_len = header_size;
+    parts[1].iov_base = const_cast<unsigned char*>(data);
+    parts[1].iov_len = (size_t)width * height * 3;
+
+    // writev may stop early on large buffers, the rest is written from where it stopped
+    int part = 0;
+    while (part < 2)
+    {
+        ssize_t written = writev(fd, parts + part, 2 - part);
+        if (written < 0)
+        {
+            (void) close(fd);
+            throw std::runtime_error("Error: The ppm file cannot be written.");
+        }
+        while (part < 2 && (size_t)written >= parts[part].iov_len)
+        {
+            written -= parts[part].iov_len;
+            ++part;
+        }
+        if (part < 2)
+        {
+            parts[part].iov_base = (char*)parts[part].iov_base + written;
+            parts[part].iov_len -= written;
+        }
+    }
+
+    if (sync && fsync(fd) != 0)
+    {
+        (void) close(fd);
+        throw std::runtime_error("Error: The ppm file cannot be synced to disk.");
+    }
+
+    (void) close(fd);
+}
@@ -1,6 +1,12 @@
 #ifndef __ppm_h__
 #define __ppm_h__
 
-void write_ppm(const char* filename, unsigned char* data, int width, int height);
+// ASCII P3, sync: fsync the file before returning
+void write_ppm(const char* filename, unsigned char* data, int width, int height,
+               bool sync = false);
+
+// binary P6, the header and the pixels go out in a single writev call
+void write_ppm_binary(const char* filename, const unsigned char* data,
+                      int width, int height, bool sync = false);
 
 #endif // __ppm_h__
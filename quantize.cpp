@@ -0,0 +1,133 @@
+#include "quantize.h"
+#include <algorithm>
+#include <immintrin.h>
+
+namespace {
+
+// t + (x - t >= 0.5) with t = trunc(x) is x + 0.5 truncated, without the
+// rounding error of adding 0.5 in single precision
+inline unsigned char quantize_scalar(float value) {
+  const float clamped = std::max(0.0f, std::min(255.0f, value));
+  const int whole = static_cast<int>(clamped);
+  return whole + (clamped - whole >= 0.5f ? 1 : 0);
+}
+
+void quantize_tail(const float *radiance, unsigned char *pixels, size_t first,
+                   size_t count) {
+  for (size_t i = first; i < count; ++i) {
+    pixels[i] = quantize_scalar(radiance[i]);
+  }
+}
+
+} // namespace
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+
+namespace sse {
+
+// min before max so that NaN becomes 255 like in std::min(255.0f, NaN)
+inline __m128i quantize4(const float *radiance) {
+  const __m128 value = _mm_max_ps(
+      _mm_min_ps(_mm_loadu_ps(radiance), _mm_set1_ps(255.0f)),
+      _mm_setzero_ps());
+  const __m128i whole = _mm_cvttps_epi32(value);
+  const __m128 fraction = _mm_sub_ps(value, _mm_cvtepi32_ps(whole));
+  const __m128i round_up = _mm_castps_si128(
+      _mm_cmpge_ps(fraction, _mm_set1_ps(0.5f)));
+  return _mm_sub_epi32(whole, round_up);
+}
+
+void quantize(const float *radiance, unsigned char *pixels, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m128i low = _mm_packs_epi32(quantize4(radiance + i),
+                                        quantize4(radiance + i + 4));
+    const __m128i high = _mm_packs_epi32(quantize4(radiance + i + 8),
+                                         quantize4(radiance + i + 12));
+    _mm_storeu_si128((__m128i *)(pixels + i), _mm_packus_epi16(low, high));
+  }
+  quantize_tail(radiance, pixels, i, count);
+}
+
+} // namespace sse
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+
+namespace avx2 {
+
+inline __m256i quantize8(const float *radiance) {
+  const __m256 value = _mm256_max_ps(
+      _mm256_min_ps(_mm256_loadu_ps(radiance), _mm256_set1_ps(255.0f)),
+      _mm256_setzero_ps());
+  const __m256i whole = _mm256_cvttps_epi32(value);
+  const __m256 fraction = _mm256_sub_ps(value, _mm256_cvtepi32_ps(whole));
+  const __m256i round_up = _mm256_castps_si256(
+      _mm256_cmp_ps(fraction, _mm256_set1_ps(0.5f), _CMP_GE_OQ));
+  return _mm256_sub_epi32(whole, round_up);
+}
+
+void quantize(const float *radiance, unsigned char *pixels, size_t count) {
+  // the packs work within 128-bit lanes, the permute puts the 32 bytes back
+  // in order
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    const __m256i low = _mm256_packs_epi32(quantize8(radiance + i),
+                                           quantize8(radiance + i + 8));
+    const __m256i high = _mm256_packs_epi32(quantize8(radiance + i + 16),
+                                            quantize8(radiance + i + 24));
+    const __m256i bytes = _mm256_permutevar8x32_epi32(
+        _mm256_packus_epi16(low, high), order);
+    _mm256_storeu_si256((__m256i *)(pixels + i), bytes);
+  }
+  quantize_tail(radiance, pixels, i, count);
+}
+
+} // namespace avx2
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,avx512f")
+
+namespace avx512 {
+
+void quantize(const float *radiance, unsigned char *pixels, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const __m512 value = _mm512_max_ps(
+        _mm512_min_ps(_mm512_loadu_ps(radiance + i), _mm512_set1_ps(255.0f)),
+        _mm512_setzero_ps());
+    const __m512i whole = _mm512_cvttps_epi32(value);
+    const __m512 fraction = _mm512_sub_ps(value, _mm512_cvtepi32_ps(whole));
+    const __mmask16 round_up =
+        _mm512_cmp_ps_mask(fraction, _mm512_set1_ps(0.5f), _CMP_GE_OQ);
+    const __m512i rounded = _mm512_mask_add_epi32(whole, round_up, whole,
+                                                  _mm512_set1_epi32(1));
+    _mm_storeu_si128((__m128i *)(pixels + i), _mm512_cvtepi32_epi8(rounded));
+  }
+  quantize_tail(radiance, pixels, i, count);
+}
+
+} // namespace avx512
+
+#pragma GCC pop_options
+
+void quantize(SimdPath path, const float *radiance, unsigned char *pixels,
+              size_t count) {
+  switch (path) {
+  case SIMD_AVX512:
+    avx512::quantize(radiance, pixels, count);
+    break;
+  case SIMD_AVX2:
+    avx2::quantize(radiance, pixels, count);
+    break;
+  default:
+    sse::quantize(radiance, pixels, count);
+    break;
+  }
+}
@@ -0,0 +1,12 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include "cpu.h"
+#include <cstddef>
+
+// clamps radiance to [0, 255] and rounds half up to bytes, the single place
+// where the float framebuffer becomes an 8-bit image
+void quantize(SimdPath path, const float *radiance, unsigned char *pixels,
+              size_t count);
+
+#endif // QUANTIZE_H
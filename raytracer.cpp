@@ -1,96 +1,421 @@
-#include "Ray.h"
-#include "color.h"
-#include "intersect.h"
+#include "bvh_cache.h"
+#include "compact_geometry.h"
+#include "cpu.h"
+#include "paged_geometry.h"
 #include "parser.h"
-#include "ppm.h"
-#include "utils.h"
+#include "render.h"
+#include "scene_cache.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+#include "write_queue.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
 #include <pthread.h>
+#include <stdexcept>
+#include <string>
+#include <time.h>
+#include <vector>
 
 typedef unsigned char RGB[3];
 
-struct ThreadData {
-  int start;
-  int end;
-  int nx;
-  parser::Camera *cam;
-  unsigned char *image;
-  float pixel_width;
-  float pixel_height;
-  parser::Scene *scene;
-  int i;
+typedef std::chrono::steady_clock Clock;
+
+double elapsed_ms(const Clock::time_point &start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+      .count();
+}
+
+// cpu time of the calling thread, unlike wall time it does not count the
+// time a thread waits for a core when there are more threads than cores
+double thread_cpu_ms() {
+  timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+// renders every tile of the camera into image on the pool, busy_ms[t] gets
+// the cpu time the t-th task spent on tiles
+void render_camera(ThreadPool &pool, const parser::Scene &scene,
+                   const parser::Camera &cam, SimdPath simd,
+                   TileScheduler &tiles, float *image,
+                   std::vector<double> &busy_ms) {
+  busy_ms.assign(pool.size(), 0.0);
+  // one task per thread, each drains its own deque of tiles then steals
+  pool.parallel_for(0, pool.size(), 1, [&](int task, int) {
+    const double busy_start = thread_cpu_ms();
+    Tile tile;
+    while (tiles.next(task, tile)) {
+      render_block(simd, scene, cam, tile.x_begin, tile.y_begin, tile.x_end,
+                   tile.y_end, image);
+    }
+    busy_ms[task] = thread_cpu_ms() - busy_start;
+  });
+}
+
+// renders all cameras of the scene from one tile queue, so threads move on
+// to the next camera instead of idling on the tail of the current one; an
+// image is queued for writing by the thread that completes its last tile
+void render_cameras_concurrently(ThreadPool &pool, const parser::Scene &scene,
+                                 SimdPath simd, WriteQueue &writes,
+                                 std::vector<double> &busy_ms) {
+  const size_t camera_count = scene.cameras.size();
+  std::vector<ImageSize> sizes(camera_count);
+  std::vector<float *> images(camera_count);
+  for (size_t c = 0; c < camera_count; ++c) {
+    const parser::Camera &cam = scene.cameras[c];
+    sizes[c] = ImageSize{cam.image_width, cam.image_height};
+    images[c] = new float[(size_t)cam.image_width * cam.image_height * 3];
+  }
+  TileScheduler tiles(sizes, pool.size());
+  std::vector<std::atomic<int> > remaining(camera_count);
+  for (size_t c = 0; c < camera_count; ++c) {
+    remaining[c] = tiles.tile_count(c);
+  }
+  pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+  const Clock::time_point render_start = Clock::now();
+
+  busy_ms.assign(pool.size(), 0.0);
+  pool.parallel_for(0, pool.size(), 1, [&](int task, int) {
+    double busy = 0.0;
+    double busy_start = thread_cpu_ms();
+    Tile tile;
+    while (tiles.next(task, tile)) {
+      const parser::Camera &cam = scene.cameras[tile.image];
+      render_block(simd, scene, cam, tile.x_begin, tile.y_begin, tile.x_end,
+                   tile.y_end, images[tile.image]);
+      if (--remaining[tile.image] > 0) {
+        continue;
+      }
+      // waiting for room in the write queue is not counted as busy time
+      busy += thread_cpu_ms() - busy_start;
+      pthread_mutex_lock(&output_mutex);
+      std::cout << "Render " << cam.image_name << ": "
+                << elapsed_ms(render_start) << " ms" << std::endl;
+      pthread_mutex_unlock(&output_mutex);
+      writes.submit(cam.image_name, images[tile.image], cam.image_width,
+                    cam.image_height);
+      busy_start = thread_cpu_ms();
+    }
+    busy_ms[task] = busy + thread_cpu_ms() - busy_start;
+  });
+
+  std::cout << "  " << tiles.tile_count() << " tiles of " << TILE_SIZE << "x"
+            << TILE_SIZE << " over " << camera_count
+            << " cameras, busy ms per thread:";
+  for (size_t t = 0; t < busy_ms.size(); t++) {
+    std::cout << " " << busy_ms[t];
+  }
+  std::cout << std::endl;
+}
+
+// renders the cameras of the scene one after the other, each image is
+// written in the background while the next camera renders
+void render_cameras_in_turn(ThreadPool &pool, const parser::Scene &scene,
+                            SimdPath simd, WriteQueue &writes,
+                            std::vector<double> &busy_ms) {
+  for (const parser::Camera &cam : scene.cameras) {
+    Clock::time_point render_start = Clock::now();
+    const int nx = cam.image_width;
+    const int ny = cam.image_height;
+    float *image = new float[(size_t)nx * ny * 3];
+
+    TileScheduler tiles(nx, ny, pool.size());
+    render_camera(pool, scene, cam, simd, tiles, image, busy_ms);
+    std::cout << "Render " << cam.image_name << ": "
+              << elapsed_ms(render_start) << " ms" << std::endl;
+
+    // a thread finishes once no tile is left anywhere, so with a good
+    // balance all of them are busy for about the same time
+    std::cout << "  " << tiles.tile_count() << " tiles of " << TILE_SIZE
+              << "x" << TILE_SIZE << ", busy ms per thread:";
+    for (size_t t = 0; t < busy_ms.size(); t++) {
+      std::cout << " " << busy_ms[t];
+    }
+    std::cout << std::endl;
+
+    writes.submit(cam.image_name, image, nx, ny);
+  }
+}
+
+// how well the budget held the working set of the renders of a scene
+void print_paging_stats(const PagedGeometry &geometry) {
+  const PagingStats stats = geometry.stats();
+  const double mb = 1024.0 * 1024.0;
+  std::cout << "Geometry paging: " << stats.lookups << " lookups, "
+            << (stats.lookups ? 100.0 * (stats.lookups - stats.misses) /
+                                    stats.lookups
+                              : 100.0)
+            << "% hit rate, " << stats.bytes_paged / mb << " MB paged in, "
+            << stats.evictions << " evictions, peak "
+            << stats.peak_resident_bytes / mb << " MB resident" << std::endl;
+}
+
+// a cache that cannot be written only costs the next run its speedup
+void warn_cache_not_saved(const char *cache, const std::exception &e) {
+  std::cerr << "Warning: " << cache << " cache not saved, " << e.what()
+            << std::endl;
+}
+
+struct Options {
+  std::vector<const char *> scene_files;
+  parser::BVHBuilder builder;
+  bool dom_loader; // tinyxml2 instead of the mapped loader
+  int threads; // 0 picks the number from the environment or the machine
+  bool concurrent_cameras;
+  bool fsync;
+  bool ascii_ppm;
+  bool load_only; // stop after parsing, used by bench_parse.sh
+  const char *cache_dir; // binary scene caches, NULL parses every time
+  bool bvh_cache; // built hierarchies next to the scene files
+  int geometry_budget_mb; // leaf geometry paged through this much memory
+                          // while rendering, 0 keeps it in core; without
+                          // the caches mesh faces are spilled while parsing
+  bool compact_geometry; // quantized leaves, not with --out-of-core
 };
 
-void *render(void *args) {
-  struct ThreadData *data;
-  data = (struct ThreadData *)args;
-  int start = data->start;
-  int end = data->end;
-  int nx = data->nx;
-  parser::Camera *cam = data->cam;
-  unsigned char *image = data->image;
-  float pixel_width = data->pixel_width;
-  float pixel_height = data->pixel_height;
-  parser::Scene *scene = data->scene;
-  int i = data->i;
-
-  for (int y = start; y < end; ++y) {
-    for (int x = 0; x < nx; ++x) {
-      Ray r = generate_ray(*cam, x, y, pixel_width, pixel_height);
-      Intersection intersection = intersect_objects(r, *scene);
-      parser::Vec3i color = compute_color(*scene, intersection, r);
-      image[i++] = color.x;
-      image[i++] = color.y;
-      image[i++] = color.z;
+void print_usage(const char *program) {
+  std::cerr << "Usage: " << program
+            << " [--bvh sah|lbvh] [--xml mmap|dom] [--threads N]"
+            << " [--concurrent-cameras] [--fsync] [--ascii-ppm] [--load-only]"
+            << " [--scene-cache DIR] [--bvh-cache] [--out-of-core MB]"
+            << " [--compact-geometry]"
+            << " <scene.xml>..." << std::endl;
+  std::cerr << "  --out-of-core MB pages the leaf geometry through MB while"
+            << " rendering; mesh faces are written to disk as they are read"
+            << " and only their boxes are kept for the BVH build, unless a"
+            << " scene or BVH cache needs the whole scene in memory"
+            << std::endl;
+}
+
+bool parse_options(int argc, char *argv[], Options &options) {
+  options.scene_files.clear();
+  options.builder = parser::SAH_BUILDER;
+  options.dom_loader = false;
+  options.threads = 0;
+  options.concurrent_cameras = false;
+  options.fsync = false;
+  options.ascii_ppm = false;
+  options.load_only = false;
+  options.cache_dir = NULL;
+  options.bvh_cache = false;
+  options.geometry_budget_mb = 0;
+  options.compact_geometry = false;
+
+  for (int a = 1; a < argc; ++a) {
+    if (std::strcmp(argv[a], "--bvh") == 0 && a + 1 < argc) {
+      const char *value = argv[++a];
+      if (std::strcmp(value, "sah") == 0) {
+        options.builder = parser::SAH_BUILDER;
+      } else if (std::strcmp(value, "lbvh") == 0) {
+        options.builder = parser::LBVH_BUILDER;
+      } else {
+        return false;
+      }
+    } else if (std::strcmp(argv[a], "--xml") == 0 && a + 1 < argc) {
+      const char *value = argv[++a];
+      if (std::strcmp(value, "mmap") == 0) {
+        options.dom_loader = false;
+      } else if (std::strcmp(value, "dom") == 0) {
+        options.dom_loader = true;
+      } else {
+        return false;
+      }
+    } else if (std::strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+      options.threads = std::atoi(argv[++a]);
+      if (options.threads <= 0) {
+        return false;
+      }
+    } else if (std::strcmp(argv[a], "--concurrent-cameras") == 0) {
+      options.concurrent_cameras = true;
+    } else if (std::strcmp(argv[a], "--fsync") == 0) {
+      options.fsync = true;
+    } else if (std::strcmp(argv[a], "--ascii-ppm") == 0) {
+      options.ascii_ppm = true;
+    } else if (std::strcmp(argv[a], "--load-only") == 0) {
+      options.load_only = true;
+    } else if (std::strcmp(argv[a], "--scene-cache") == 0 && a + 1 < argc) {
+      options.cache_dir = argv[++a];
+    } else if (std::strcmp(argv[a], "--bvh-cache") == 0) {
+      options.bvh_cache = true;
+    } else if (std::strcmp(argv[a], "--out-of-core") == 0 && a + 1 < argc) {
+      options.geometry_budget_mb = std::atoi(argv[++a]);
+      if (options.geometry_budget_mb <= 0) {
+        return false;
+      }
+    } else if (std::strcmp(argv[a], "--compact-geometry") == 0) {
+      options.compact_geometry = true;
+    } else if (argv[a][0] != '-') {
+      options.scene_files.push_back(argv[a]);
+    } else {
+      return false;
     }
   }
-  pthread_exit(NULL);
+  return !options.scene_files.empty() &&
+         !(options.compact_geometry && options.geometry_budget_mb > 0);
 }
 
-const int THREADS = 8;
+// --threads, then RAYTRACER_THREADS, then the cores available to the process
+int thread_count(const Options &options) {
+  if (options.threads > 0) {
+    return options.threads;
+  }
+  const char *requested = getenv("RAYTRACER_THREADS");
+  if (requested != NULL && requested[0] != '\0') {
+    const int threads = std::atoi(requested);
+    if (threads <= 0) {
+      throw std::runtime_error("Error: RAYTRACER_THREADS must be a positive "
+                               "number, got " +
+                               std::string(requested));
+    }
+    return threads;
+  }
+  return available_cpu_count();
+}
 
 int main(int argc, char *argv[]) {
-  // Sample usage for reading an XML scene file
-  parser::Scene scene;
-
-  scene.loadFromXml(argv[1]);
-
-  pthread_t threads[THREADS];
-  struct ThreadData thread_data[THREADS];
-  int nx, ny;
-
-  for (parser::Camera cam : scene.cameras) {
-    nx = cam.image_width;
-    ny = cam.image_height;
-    unsigned char *image = new unsigned char[nx * ny * 3];
-    float pixel_width = (cam.near_plane.y - cam.near_plane.x) / nx;
-    float pixel_height = (cam.near_plane.w - cam.near_plane.z) / ny;
-
-    int rows_per_thread = ny / THREADS;
-    int remaining_rows = ny % THREADS;
-    int start = 0;
-    int i = 0;
-
-    for (int t = 0; t < THREADS; t++) {
-      int end = start + rows_per_thread;
-      if (t == THREADS - 1) {
-        end += remaining_rows;
-      }
-      i = start * nx * 3;
+  Options options;
+  if (!parse_options(argc, argv, options)) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  bool simd_forced;
+  const SimdPath simd =
+      select_simd_path(detect_cpu_features(), simd_forced);
+  std::cout << "SIMD path: " << simd_path_name(simd)
+            << (simd_forced ? " (forced by RAYTRACER_SIMD)" : "") << std::endl;
 
-      thread_data[t] = {start,       end,          nx,     &cam, image,
-                        pixel_width, pixel_height, &scene, i};
-      pthread_create(&threads[t], NULL, render, &thread_data[t]);
+  // the pool lives for the whole run, the BVH builds and the renders of
+  // every scene and camera go through the same threads
+  ThreadPool pool(thread_count(options));
+  std::vector<double> busy_ms;
+  // images are written in the background while the next camera renders,
+  // at most two finished frames wait for the disk; PNG strips are
+  // compressed on the pool next to the render tasks
+  ImageWriterOptions writer_options = {options.ascii_ppm, options.fsync,
+                                       &pool, simd};
+  WriteQueue writes(2, writer_options);
 
-      start = end;
+  for (size_t f = 0; f < options.scene_files.size(); ++f) {
+    parser::Scene scene;
+
+    Clock::time_point load_start = Clock::now();
+    // the cache is keyed by the bytes of the XML, an edited scene no longer
+    // matches and is parsed and cached again
+    std::string cache_path;
+    uint64_t source_hash = 0;
+    bool cached = false;
+    if (options.cache_dir != NULL) {
+      cache_path = scene_cache_path(options.cache_dir, options.scene_files[f]);
+      source_hash = hash_file(options.scene_files[f]);
+      cached = load_scene_cache(cache_path, source_hash, options.builder,
+                                scene);
+    }
+    // the caches are written from the geometry in memory
+    if (options.geometry_budget_mb > 0 && options.cache_dir == NULL &&
+        !options.bvh_cache) {
+      scene.spilled_faces.reset(new SpilledFaces());
+    }
+    if (!cached && options.dom_loader) {
+      scene.loadFromXml(options.scene_files[f], pool);
+    } else if (!cached) {
+      scene.loadFromXmlMapped(options.scene_files[f], pool);
+    }
+    std::cout << "Scene load ("
+              << (cached ? "cache" : options.dom_loader ? "dom" : "mmap")
+              << "): " << elapsed_ms(load_start) << " ms" << std::endl;
+    if (options.load_only) {
+      continue;
     }
 
-    for (int t = 0; t < THREADS; t++) {
-      pthread_join(threads[t], NULL);
+    const char *builder_name =
+        options.builder == parser::LBVH_BUILDER ? "lbvh" : "sah";
+    if (cached && scene.bvh_node_count > 0) {
+      std::cout << "BVH (" << builder_name << ") from scene cache, "
+                << scene.primitives.size() << " primitives, "
+                << scene.bvh_node_count << " nodes" << std::endl;
+    } else {
+      // the BVH cache only depends on the geometry, it stays valid when
+      // materials, lights or cameras are edited
+      Clock::time_point build_start = Clock::now();
+      const std::string bvh_path =
+          bvh_cache_path(options.scene_files[f], options.builder);
+      if (options.bvh_cache &&
+          load_bvh_cache(bvh_path, options.builder, pool, scene)) {
+        std::cout << "BVH (" << builder_name << ") mapped from " << bvh_path
+                  << ": " << elapsed_ms(build_start) << " ms, "
+                  << scene.primitives.size() << " primitives, "
+                  << scene.bvh_node_count << " nodes" << std::endl;
+      } else {
+        scene.buildBVH(pool, options.builder);
+        std::cout << "BVH build (" << builder_name
+                  << "): " << elapsed_ms(build_start) << " ms, "
+                  << scene.primitives.size() << " primitives, "
+                  << scene.bvh_node_count << " nodes, " << pool.size()
+                  << " threads" << std::endl;
+        if (options.bvh_cache) {
+          try {
+            save_bvh_cache(bvh_path, options.builder, scene);
+          } catch (const std::exception &e) {
+            warn_cache_not_saved("BVH", e);
+          }
+        }
+      }
+      // in core leaves and the scene cache read triangle_soa, paged and
+      // compact geometry are made from the faces without it
+      const bool in_core =
+          options.geometry_budget_mb == 0 && !options.compact_geometry;
+      if (in_core || options.cache_dir != NULL) {
+        scene.buildTriangleSoA(pool);
+      }
+      if (options.cache_dir != NULL) {
+        try {
+          save_scene_cache(cache_path, source_hash, options.builder, true,
+                           scene);
+        } catch (const std::exception &e) {
+          warn_cache_not_saved("scene", e);
+        }
+      }
+    }
+
+    // the chunks are made from the spilled faces, or from the geometry in
+    // memory when a cache needed it
+    if (options.geometry_budget_mb > 0) {
+      Clock::time_point page_start = Clock::now();
+      page_out_geometry(pool, scene,
+                        (size_t)options.geometry_budget_mb << 20);
+      const PagedGeometry &geometry = *scene.paged_geometry;
+      std::cout << "Geometry paged out: " << elapsed_ms(page_start) << " ms, "
+                << geometry.chunk_count() << " chunks, "
+                << geometry.file_bytes() / (1024.0 * 1024.0)
+                << " MB on disk, budget " << options.geometry_budget_mb
+                << " MB" << std::endl;
+    } else if (options.compact_geometry) {
+      Clock::time_point compact_start = Clock::now();
+      const size_t primitive_count = scene.primitives.size();
+      compact_geometry(pool, scene);
+      const CompactGeometry &geometry = *scene.compact_geometry;
+      std::cout << "Geometry compacted: " << elapsed_ms(compact_start)
+                << " ms, " << geometry.block_count() << " blocks, "
+                << geometry.bytes() / (1024.0 * 1024.0) << " MB, "
+                << (primitive_count ? (double)geometry.bytes() / primitive_count
+                                    : 0.0)
+                << " bytes per primitive" << std::endl;
     }
 
-    write_ppm(cam.image_name.c_str(), image, nx, ny);
-    delete[] image;
+    if (options.concurrent_cameras) {
+      render_cameras_concurrently(pool, scene, simd, writes, busy_ms);
+    } else {
+      render_cameras_in_turn(pool, scene, simd, writes, busy_ms);
+    }
+    if (scene.paged_geometry) {
+      print_paging_stats(*scene.paged_geometry);
+    }
   }
+  writes.finish();
 
   return 0;
 }
@@ -0,0 +1,40 @@
+#include "render.h"
+#include "color.h"
+#include "intersect.h"
+
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+namespace sse {
+#include "shading.inl"
+} // namespace sse
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace avx2 {
+#include "shading.inl"
+} // namespace avx2
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,avx512f")
+namespace avx512 {
+#include "shading.inl"
+} // namespace avx512
+#pragma GCC pop_options
+
+void render_block(SimdPath path, const parser::Scene &scene,
+                  const parser::Camera &cam, int x_begin, int y_begin,
+                  int x_end, int y_end, float *image) {
+  switch (path) {
+  case SIMD_AVX512:
+    avx512::render_block(scene, cam, x_begin, y_begin, x_end, y_end, image);
+    break;
+  case SIMD_AVX2:
+    avx2::render_block(scene, cam, x_begin, y_begin, x_end, y_end, image);
+    break;
+  default:
+    sse::render_block(scene, cam, x_begin, y_begin, x_end, y_end, image);
+    break;
+  }
+}
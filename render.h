@@ -0,0 +1,14 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "cpu.h"
+#include "parser.h"
+
+// shades the pixels [x_begin, x_end) x [y_begin, y_end) of the camera into
+// image, a width * height * 3 float radiance buffer, with the kernels of the
+// given path
+void render_block(SimdPath path, const parser::Scene &scene,
+                  const parser::Camera &cam, int x_begin, int y_begin,
+                  int x_end, int y_end, float *image);
+
+#endif // RENDER_H
@@ -0,0 +1,431 @@
+#include "scene_cache.h"
+#include "bvh_cache.h"
+#include "mapped_file.h"
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+
+const char MAGIC[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t layout;      // struct sizes of the build that wrote the file
+  uint64_t source_hash; // of the XML the scene was parsed from
+  int32_t bvh_builder;  // -1 when the file has no BVH
+  uint32_t reserved;
+  uint64_t size; // of the whole file, a truncated write does not load
+};
+
+// the arrays are copied as they are in memory, a build whose structs are
+// laid out differently cannot read them
+uint32_t layout_hash() {
+  const uint64_t sizes[] = {
+      sizeof(parser::Vec3f),      sizeof(parser::Vec3i),
+      sizeof(parser::Vec4f),      sizeof(parser::PointLight),
+      sizeof(parser::Material),   sizeof(parser::Face),
+      sizeof(parser::Triangle),   sizeof(parser::Sphere),
+      sizeof(parser::Primitive),  sizeof(parser::WideBVHNode),
+      parser::BVH_WIDTH,          parser::TRIANGLE_SOA_PADDING};
+  return (uint32_t)hash_bytes((const char *)sizes, sizeof(sizes));
+}
+
+class CacheWriter {
+public:
+  explicit CacheWriter(const std::string &path) : path(path), written(0) {
+    file = std::fopen(path.c_str(), "wb");
+    if (file == NULL) {
+      throw std::runtime_error("Error: " + path +
+                               " cannot be opened for writing.");
+    }
+  }
+  ~CacheWriter() {
+    if (file != NULL) {
+      std::fclose(file);
+    }
+  }
+
+  void bytes(const void *data, size_t size) {
+    if (size > 0 && std::fwrite(data, 1, size, file) != size) {
+      throw std::runtime_error("Error: " + path + " cannot be written.");
+    }
+    written += size;
+  }
+
+  template <typename T> void value(const T &v) { bytes(&v, sizeof(T)); }
+
+  // element count, then the elements as they are in memory
+  template <typename Vector> void array(const Vector &v) {
+    value((uint64_t)v.size());
+    bytes(v.data(), v.size() * sizeof(v[0]));
+  }
+
+  uint64_t size() const { return written; }
+
+  void close() {
+    const int failed = std::fclose(file);
+    file = NULL;
+    if (failed != 0) {
+      throw std::runtime_error("Error: " + path + " cannot be written.");
+    }
+  }
+
+private:
+  CacheWriter(const CacheWriter &);
+  CacheWriter &operator=(const CacheWriter &);
+
+  std::string path;
+  std::FILE *file;
+  uint64_t written;
+};
+
+// reads the sections back out of the mapping, any read past the end marks
+// the file as damaged instead of throwing
+class CacheReader {
+public:
+  CacheReader(const char *begin, const char *end)
+      : cursor(begin), end(end), ok(true) {}
+
+  bool good() const { return ok; }
+  bool at_end() const { return cursor == end; }
+
+  void bytes(void *data, size_t size) {
+    if (!ok || size > (size_t)(end - cursor)) {
+      ok = false;
+      return;
+    }
+    if (size > 0) {
+      std::memcpy(data, cursor, size);
+    }
+    cursor += size;
+  }
+
+  template <typename T> void value(T &v) { bytes(&v, sizeof(T)); }
+
+  template <typename Vector> void array(Vector &v) {
+    uint64_t count = 0;
+    value(count);
+    if (!ok || count > (uint64_t)(end - cursor) / sizeof(v[0])) {
+      ok = false;
+      return;
+    }
+    v.resize(count);
+    bytes(v.data(), count * sizeof(v[0]));
+  }
+
+private:
+  const char *cursor;
+  const char *end;
+  bool ok;
+};
+
+template <typename Stream, typename Camera>
+void camera_fields(Stream &stream, Camera &camera) {
+  stream.value(camera.position);
+  stream.value(camera.gaze);
+  stream.value(camera.up);
+  stream.value(camera.w);
+  stream.value(camera.u);
+  stream.value(camera.q);
+  stream.value(camera.near_plane);
+  stream.value(camera.plane_center);
+  stream.value(camera.near_distance);
+  stream.value(camera.image_width);
+  stream.value(camera.image_height);
+}
+
+template <typename Stream, typename TriangleSoA>
+void soa_fields(Stream &stream, TriangleSoA &soa) {
+  stream.array(soa.v0_x);
+  stream.array(soa.v0_y);
+  stream.array(soa.v0_z);
+  stream.array(soa.edge1_x);
+  stream.array(soa.edge1_y);
+  stream.array(soa.edge1_z);
+  stream.array(soa.edge2_x);
+  stream.array(soa.edge2_y);
+  stream.array(soa.edge2_z);
+}
+
+// vertex and material ids count from 1 as in the XML
+bool id_valid(int id, size_t count) {
+  return id >= 1 && (size_t)id <= count;
+}
+
+bool face_valid(const parser::Face &face, size_t vertex_count) {
+  return id_valid(face.v0_id, vertex_count) &&
+         id_valid(face.v1_id, vertex_count) &&
+         id_valid(face.v2_id, vertex_count);
+}
+
+// every index the renderer follows without checking, a damaged file that
+// still has the right size must not send it outside an array
+bool contents_valid(const parser::Scene &scene) {
+  const size_t vertex_count = scene.vertex_data.size();
+  const size_t material_count = scene.materials.size();
+  size_t primitive_count = scene.spheres.size() + scene.triangles.size();
+  for (size_t m = 0; m < scene.meshes.size(); ++m) {
+    const parser::Mesh &mesh = scene.meshes[m];
+    if (!id_valid(mesh.material_id, material_count)) {
+      return false;
+    }
+    for (size_t f = 0; f < mesh.faces.size(); ++f) {
+      if (!face_valid(mesh.faces[f], vertex_count)) {
+        return false;
+      }
+    }
+    primitive_count += mesh.faces.size();
+  }
+  for (size_t t = 0; t < scene.triangles.size(); ++t) {
+    if (!id_valid(scene.triangles[t].material_id, material_count) ||
+        !face_valid(scene.triangles[t].indices, vertex_count)) {
+      return false;
+    }
+  }
+  for (size_t s = 0; s < scene.spheres.size(); ++s) {
+    const parser::Sphere &sphere = scene.spheres[s];
+    if (!id_valid(sphere.material_id, material_count) ||
+        !id_valid(sphere.center_vertex_id, vertex_count)) {
+      return false;
+    }
+  }
+  if (scene.bvh_nodes.empty()) {
+    // no tree came with the file, one is built as after parsing
+    return true;
+  }
+  if (scene.primitives.size() != primitive_count ||
+      primitive_count > (size_t)std::numeric_limits<int>::max() ||
+      scene.bvh_nodes.size() > (size_t)std::numeric_limits<int>::max() ||
+      !nodes_valid(scene.bvh_nodes.data(), scene.bvh_nodes.size(),
+                   primitive_count)) {
+    return false;
+  }
+  for (size_t i = 0; i < primitive_count; ++i) {
+    const parser::Primitive &p = scene.primitives[i];
+    const size_t object = p.object_id;
+    const bool valid =
+        p.object_id >= 0 &&
+        (p.type == parser::SPHERE     ? object < scene.spheres.size()
+         : p.type == parser::TRIANGLE ? object < scene.triangles.size()
+         : p.type == parser::MESH_FACE
+             ? object < scene.meshes.size() && p.face_id >= 0 &&
+                   (size_t)p.face_id < scene.meshes[object].faces.size()
+             : false);
+    if (!valid) {
+      return false;
+    }
+  }
+  const parser::TriangleSoA &soa = scene.triangle_soa;
+  const parser::AlignedFloats *fields[] = {
+      &soa.v0_x,    &soa.v0_y,    &soa.v0_z,    &soa.edge1_x, &soa.edge1_y,
+      &soa.edge1_z, &soa.edge2_x, &soa.edge2_y, &soa.edge2_z};
+  for (size_t k = 0; k < sizeof(fields) / sizeof(fields[0]); ++k) {
+    if (fields[k]->size() != primitive_count + parser::TRIANGLE_SOA_PADDING) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+uint64_t hash_bytes(const char *data, size_t size) {
+  const uint64_t k0 = 0x9e3779b97f4a7c15ull, k1 = 0xff51afd7ed558ccdull;
+  uint64_t h = k0 ^ size;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    h ^= word * k1;
+    h = ((h << 29) | (h >> 35)) * k0;
+  }
+  uint64_t tail = 0;
+  if (i < size) {
+    std::memcpy(&tail, data + i, size - i);
+  }
+  h ^= tail * k1;
+  // murmur3 finalizer so every input bit reaches every output bit
+  h ^= h >> 33;
+  h *= k1;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+uint64_t hash_file(const std::string &path) {
+  const MappedFile file(path);
+  return hash_bytes(file.data(), file.size());
+}
+
+std::string scene_cache_path(const std::string &cache_dir,
+                             const std::string &scene_file) {
+  const size_t slash = scene_file.find_last_of('/');
+  const std::string name =
+      slash == std::string::npos ? scene_file : scene_file.substr(slash + 1);
+  return cache_dir + "/" + name + ".cache";
+}
+
+bool load_scene_cache(const std::string &path, uint64_t source_hash,
+                      parser::BVHBuilder builder, parser::Scene &scene) {
+  if (access(path.c_str(), R_OK) != 0) {
+    return false;
+  }
+  const MappedFile file(path);
+  CacheHeader header;
+  if (file.size() < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != SCENE_CACHE_VERSION ||
+      header.layout != layout_hash() || header.source_hash != source_hash ||
+      header.size != file.size()) {
+    return false;
+  }
+
+  parser::Scene loaded;
+  CacheReader reader(file.data() + sizeof(header), file.data() + file.size());
+  // the mesh files come first, a stale one is found before anything else is
+  // copied
+  uint64_t mesh_file_count = 0;
+  reader.value(mesh_file_count);
+  for (uint64_t f = 0; f < mesh_file_count && reader.good(); ++f) {
+    std::vector<char> name;
+    uint64_t hash = 0;
+    reader.array(name);
+    reader.value(hash);
+    const std::string mesh_file(name.begin(), name.end());
+    if (!reader.good() || access(mesh_file.c_str(), R_OK) != 0 ||
+        hash_file(mesh_file) != hash) {
+      return false;
+    }
+    loaded.mesh_files.push_back(mesh_file);
+  }
+  reader.value(loaded.background_color);
+  reader.value(loaded.shadow_ray_epsilon);
+  reader.value(loaded.max_recursion_depth);
+  reader.value(loaded.ambient_light);
+
+  uint64_t camera_count = 0;
+  reader.value(camera_count);
+  for (uint64_t c = 0; c < camera_count && reader.good(); ++c) {
+    parser::Camera camera;
+    camera_fields(reader, camera);
+    std::vector<char> name;
+    reader.array(name);
+    camera.image_name.assign(name.begin(), name.end());
+    loaded.cameras.push_back(camera);
+  }
+
+  reader.array(loaded.point_lights);
+  reader.array(loaded.materials);
+  reader.array(loaded.vertex_data);
+  uint64_t mesh_count = 0;
+  reader.value(mesh_count);
+  for (uint64_t m = 0; m < mesh_count && reader.good(); ++m) {
+    loaded.meshes.push_back(parser::Mesh());
+    reader.value(loaded.meshes.back().material_id);
+    reader.array(loaded.meshes.back().faces);
+  }
+  reader.array(loaded.triangles);
+  reader.array(loaded.spheres);
+
+  if (header.bvh_builder >= 0) {
+    reader.array(loaded.primitives);
+    reader.array(loaded.bvh_nodes);
+    soa_fields(reader, loaded.triangle_soa);
+    if (header.bvh_builder != builder) {
+      loaded.primitives.clear();
+      loaded.bvh_nodes.clear();
+      loaded.triangle_soa = parser::TriangleSoA();
+    }
+  }
+  if (!reader.good() || !reader.at_end() || !contents_valid(loaded)) {
+    return false;
+  }
+  std::swap(scene, loaded);
+  scene.bvh_node_array = scene.bvh_nodes.data();
+  scene.bvh_node_count = scene.bvh_nodes.size();
+  return true;
+}
+
+void save_scene_cache(const std::string &path, uint64_t source_hash,
+                      parser::BVHBuilder builder, bool with_bvh,
+                      const parser::Scene &scene) {
+  char pid[32];
+  std::snprintf(pid, sizeof(pid), ".%d.tmp", (int)getpid());
+  const std::string temporary = path + pid;
+
+  CacheHeader header;
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = SCENE_CACHE_VERSION;
+  header.layout = layout_hash();
+  header.source_hash = source_hash;
+  header.bvh_builder = with_bvh ? builder : -1;
+  header.reserved = 0;
+  header.size = 0;
+
+  try {
+    CacheWriter writer(temporary);
+    writer.value(header);
+    writer.value((uint64_t)scene.mesh_files.size());
+    for (size_t f = 0; f < scene.mesh_files.size(); ++f) {
+      writer.array(scene.mesh_files[f]);
+      writer.value(hash_file(scene.mesh_files[f]));
+    }
+    writer.value(scene.background_color);
+    writer.value(scene.shadow_ray_epsilon);
+    writer.value(scene.max_recursion_depth);
+    writer.value(scene.ambient_light);
+
+    writer.value((uint64_t)scene.cameras.size());
+    for (size_t c = 0; c < scene.cameras.size(); ++c) {
+      const parser::Camera &camera = scene.cameras[c];
+      camera_fields(writer, camera);
+      writer.array(camera.image_name);
+    }
+
+    writer.array(scene.point_lights);
+    writer.array(scene.materials);
+    writer.array(scene.vertex_data);
+    writer.value((uint64_t)scene.meshes.size());
+    for (size_t m = 0; m < scene.meshes.size(); ++m) {
+      writer.value(scene.meshes[m].material_id);
+      writer.array(scene.meshes[m].faces);
+    }
+    writer.array(scene.triangles);
+    writer.array(scene.spheres);
+
+    if (with_bvh) {
+      writer.array(scene.primitives);
+      // the nodes may live in a mapped BVH cache instead of bvh_nodes
+      writer.value((uint64_t)scene.bvh_node_count);
+      writer.bytes(scene.bvh_node_array,
+                   scene.bvh_node_count * sizeof(parser::WideBVHNode));
+      soa_fields(writer, scene.triangle_soa);
+    }
+    writer.close();
+
+    // the size goes in last, a file cut short by a crash never validates
+    header.size = writer.size();
+    std::FILE *file = std::fopen(temporary.c_str(), "r+b");
+    if (file == NULL) {
+      throw std::runtime_error("Error: " + temporary + " cannot be written.");
+    }
+    const bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    if (std::fclose(file) != 0 || !written) {
+      throw std::runtime_error("Error: " + temporary + " cannot be written.");
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+      throw std::runtime_error("Error: " + path + " cannot be replaced.");
+    }
+  } catch (...) {
+    std::remove(temporary.c_str());
+    throw;
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "parser.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Binary snapshot of a parsed scene: a header followed by the flat arrays of
+// parser::Scene, optionally with the built BVH. Loading maps the file and
+// copies the arrays, nothing is parsed. The header records the hash of the
+// source XML and the file lists every PLY or OBJ file the meshes were
+// imported from with the hash of its contents; a cache whose XML or mesh
+// files differ is stale and is not loaded.
+const uint32_t SCENE_CACHE_VERSION = 2;
+
+// 64-bit hash of a block of bytes, the key of the cached scene
+uint64_t hash_bytes(const char *data, size_t size);
+// throws if the file cannot be read
+uint64_t hash_file(const std::string &path);
+
+// the cache of a scene file inside a cache directory
+std::string scene_cache_path(const std::string &cache_dir,
+                             const std::string &scene_file);
+
+// false when the cache is missing, stale, damaged or written by a build with
+// another layout. The BVH is only taken when it was built by builder,
+// otherwise scene.bvh_node_count is left 0.
+bool load_scene_cache(const std::string &path, uint64_t source_hash,
+                      parser::BVHBuilder builder, parser::Scene &scene);
+// the file is written next to path and renamed over it, so concurrent jobs
+// never read a partial cache; with_bvh stores the hierarchy built by builder
+void save_scene_cache(const std::string &path, uint64_t source_hash,
+                      parser::BVHBuilder builder, bool with_bvh,
+                      const parser::Scene &scene);
+
+#endif // SCENE_CACHE_H
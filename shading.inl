@@ -0,0 +1,144 @@
+// Shading, intentionally without include guards: render.cpp includes it
+// once per instruction set, inside the namespace holding the traversal for
+// that set, so the whole path of a pixel is compiled for the same target.
+
+inline Intersection intersect_objects(const Ray &r, const parser::Scene &s) {
+  return make_intersection(intersect_wide(r, s), r, s);
+}
+
+// true if anything is hit along the ray before t_max, used for shadow rays
+inline bool occluded(const Ray &r, const parser::Scene &s, float t_max) {
+  return occluded_wide(r, s, t_max);
+}
+
+inline parser::Vec3f compute_color(const parser::Scene &scene,
+                                   const Intersection &intersection, Ray &r);
+
+inline parser::Vec3f apply_shading(const parser::Scene &scene,
+                                   const Intersection &intersection, Ray &r) {
+
+  // start with the ambient light
+  parser::Vec3f ambient_color = {
+      scene.ambient_light.x * intersection.material->ambient.x,
+      scene.ambient_light.y * intersection.material->ambient.y,
+      scene.ambient_light.z * intersection.material->ambient.z};
+
+  parser::Vec3f color;
+  color.x = ambient_color.x;
+  color.y = ambient_color.y;
+  color.z = ambient_color.z;
+  parser::Vec3f eye_v = subtract_vectors(r.get_origin(), intersection.point);
+  parser::Vec3f normalized_eye_v = normalize(eye_v);
+
+  int current_depth = r.get_depth();
+
+  // add the color from the mirror direction
+  if (intersection.material->is_mirror &&
+      current_depth < scene.max_recursion_depth) {
+    float cos_theta = dot_product(intersection.normal, normalized_eye_v);
+    parser::Vec3f reflected_ray_dir =
+        add_vectors(multiply_vector(normalized_eye_v, -1),
+                    multiply_vector(intersection.normal, (2 * cos_theta)));
+
+    parser::Vec3f reflected_ray_origin = add_vectors(
+        intersection.point,
+        multiply_vector(reflected_ray_dir, scene.shadow_ray_epsilon));
+
+    Ray reflected_ray(reflected_ray_origin, reflected_ray_dir);
+
+    Intersection reflected_intersection =
+        intersect_objects(reflected_ray, scene);
+
+    if (!reflected_intersection.is_null && reflected_intersection.t > 0.0f) {
+      reflected_ray.set_depth(current_depth + 1);
+      parser::Vec3f reflected_color =
+          compute_color(scene, reflected_intersection, reflected_ray);
+
+      reflected_color.x *= intersection.material->mirror.x;
+      reflected_color.y *= intersection.material->mirror.y;
+      reflected_color.z *= intersection.material->mirror.z;
+
+      color.x += reflected_color.x;
+      color.y += reflected_color.y;
+      color.z += reflected_color.z;
+    }
+  }
+
+  // add the diffuse and specular terms
+
+  for (const parser::PointLight &light : scene.point_lights) {
+    parser::Vec3f to_light =
+        subtract_vectors(light.position, intersection.point);
+    if (dot_product(intersection.normal, to_light) < 0) {
+      continue;
+    }
+    parser::Vec3f to_light_normalized = normalize(to_light);
+
+    Ray shadow_ray = generate_shadow_ray(
+        scene.shadow_ray_epsilon, to_light_normalized, intersection.point);
+
+    float distance_to_light = get_magn(to_light);
+
+    // the shadow ray starts shadow_ray_epsilon away from the surface
+    if (!occluded(shadow_ray, scene,
+                  distance_to_light - scene.shadow_ray_epsilon)) {
+      parser::Vec3f irradiance = calculate_irradiance(
+          light, to_light_normalized, intersection.normal, distance_to_light);
+      parser::Vec3f diffuse =
+          calculate_diffuse(intersection.material->diffuse, irradiance,
+                            intersection.normal, to_light_normalized);
+      parser::Vec3f half = add_vectors(to_light_normalized, normalized_eye_v);
+      parser::Vec3f normalized_half = normalize(half);
+      parser::Vec3f specular = calculate_specular(
+          intersection.material->phong_exponent, intersection.normal,
+          intersection.material->specular, irradiance, normalized_half,
+          to_light);
+
+      color.x += diffuse.x + specular.x;
+      color.y += diffuse.y + specular.y;
+      color.z += diffuse.z + specular.z;
+    }
+  }
+
+  return color;
+}
+
+// radiance on the 0-255 scale of the output, clamped only when the frame
+// is quantized so that mirrors reflect highlights above 255 at full value
+inline parser::Vec3f compute_color(const parser::Scene &scene,
+                                   const Intersection &intersection, Ray &r) {
+
+  if (r.get_depth() > scene.max_recursion_depth) {
+    return {0, 0, 0};
+  }
+  if (!intersection.is_null) {
+    return apply_shading(scene, intersection, r);
+
+  } else if (r.get_depth() == 0) {
+    return {(float)scene.background_color.x, (float)scene.background_color.y,
+            (float)scene.background_color.z};
+
+  } else {
+    return {0, 0, 0};
+  }
+}
+
+void render_block(const parser::Scene &scene, const parser::Camera &cam,
+                  int x_begin, int y_begin, int x_end, int y_end,
+                  float *image) {
+  const float pixel_width =
+      (cam.near_plane.y - cam.near_plane.x) / cam.image_width;
+  const float pixel_height =
+      (cam.near_plane.w - cam.near_plane.z) / cam.image_height;
+  for (int y = y_begin; y < y_end; ++y) {
+    float *pixel = image + ((size_t)y * cam.image_width + x_begin) * 3;
+    for (int x = x_begin; x < x_end; ++x) {
+      Ray r = generate_ray(cam, x, y, pixel_width, pixel_height);
+      Intersection intersection = intersect_objects(r, scene);
+      parser::Vec3f color = compute_color(scene, intersection, r);
+      *pixel++ = color.x;
+      *pixel++ = color.y;
+      *pixel++ = color.z;
+    }
+  }
+}
@@ -0,0 +1,104 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <iterator>
+
+ThreadPool::ThreadPool(int thread_count)
+    : thread_count(std::max(1, thread_count)), parked_waiters(0),
+      stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&wake, NULL);
+  workers.resize(this->thread_count - 1);
+  for (size_t i = 0; i < workers.size(); ++i) {
+    pthread_create(&workers[i], NULL, worker_main, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&mutex);
+  for (size_t i = 0; i < workers.size(); ++i) {
+    pthread_join(workers[i], NULL);
+  }
+  pthread_cond_destroy(&wake);
+  pthread_mutex_destroy(&mutex);
+}
+
+void ThreadPool::submit(TaskGroup &group, const std::function<void()> &task) {
+  group.pending++;
+  pthread_mutex_lock(&mutex);
+  queue.push_back({task, &group});
+  // a thread parked in wait() ignores tasks of other groups, so a single
+  // wake up could be lost on it
+  if (parked_waiters > 0) {
+    pthread_cond_broadcast(&wake);
+  } else {
+    pthread_cond_signal(&wake);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+// expects the mutex to be held, releases it while the task runs
+void ThreadPool::run(Task &task) {
+  pthread_mutex_unlock(&mutex);
+  task.function();
+  const bool finished = --task.group->pending == 0;
+  pthread_mutex_lock(&mutex);
+  if (finished) {
+    // the group owner may be parked waiting for new tasks
+    pthread_cond_broadcast(&wake);
+  }
+}
+
+void ThreadPool::wait(TaskGroup &group) {
+  pthread_mutex_lock(&mutex);
+  while (group.pending > 0) {
+    // only tasks of the awaited group are run here: an unrelated task could
+    // take long or block on something the waiting thread is responsible for
+    std::deque<Task>::reverse_iterator own = queue.rbegin();
+    while (own != queue.rend() && own->group != &group) {
+      ++own;
+    }
+    if (own == queue.rend()) {
+      parked_waiters++;
+      pthread_cond_wait(&wake, &mutex);
+      parked_waiters--;
+      continue;
+    }
+    // newest first, tasks spawned by a subtree stay on the same thread
+    Task task = *own;
+    queue.erase(std::next(own).base());
+    run(task);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void ThreadPool::parallel_for(int begin, int end, int grain,
+                              const std::function<void(int, int)> &body) {
+  grain = std::max(1, grain);
+  TaskGroup group;
+  for (int first = begin; first < end; first += grain) {
+    const int last = std::min(end, first + grain);
+    submit(group, [&body, first, last]() { body(first, last); });
+  }
+  wait(group);
+}
+
+void *ThreadPool::worker_main(void *arg) {
+  ThreadPool *pool = (ThreadPool *)arg;
+  pthread_mutex_lock(&pool->mutex);
+  while (true) {
+    if (!pool->queue.empty()) {
+      Task task = pool->queue.back();
+      pool->queue.pop_back();
+      pool->run(task);
+    } else if (pool->stopping) {
+      break;
+    } else {
+      pthread_cond_wait(&pool->wake, &pool->mutex);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
@@ -0,0 +1,60 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <pthread.h>
+#include <vector>
+
+// Tasks submitted together are tracked by a group so that the submitter can
+// wait for all of them, including tasks they spawn into the same group.
+class TaskGroup {
+public:
+  TaskGroup() : pending(0) {}
+
+private:
+  friend class ThreadPool;
+  std::atomic<int> pending;
+};
+
+class ThreadPool {
+public:
+  // thread_count includes the calling thread, which executes tasks while it
+  // waits on a group, so thread_count - 1 workers are started
+  explicit ThreadPool(int thread_count);
+  ~ThreadPool();
+
+  int size() const { return thread_count; }
+
+  void submit(TaskGroup &group, const std::function<void()> &task);
+  // runs queued tasks of the group until all of them are done, any thread
+  // may wait, including ones outside the pool
+  void wait(TaskGroup &group);
+
+  // runs body(i) for every i in [begin, end) split into chunks of grain
+  void parallel_for(int begin, int end, int grain,
+                    const std::function<void(int, int)> &body);
+
+private:
+  struct Task {
+    std::function<void()> function;
+    TaskGroup *group;
+  };
+
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+
+  static void *worker_main(void *arg);
+  void run(Task &task);
+
+  int thread_count;
+  std::vector<pthread_t> workers;
+  std::deque<Task> queue;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  int parked_waiters; // threads sleeping in wait(), guarded by mutex
+  bool stopping;
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,83 @@
+#include "tile_scheduler.h"
+#include <algorithm>
+
+TileScheduler::TileScheduler(int width, int height, int thread_count)
+    : count(0), queues(std::max(1, thread_count)) {
+  deal(std::vector<ImageSize>(1, ImageSize{width, height}));
+}
+
+TileScheduler::TileScheduler(const std::vector<ImageSize> &images,
+                             int thread_count)
+    : count(0), queues(std::max(1, thread_count)) {
+  deal(images);
+}
+
+void TileScheduler::deal(const std::vector<ImageSize> &images) {
+  for (size_t q = 0; q < queues.size(); ++q) {
+    pthread_mutex_init(&queues[q].mutex, NULL);
+  }
+  for (size_t i = 0; i < images.size(); ++i) {
+    const int width = images[i].width;
+    const int height = images[i].height;
+    const int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    const int total = tiles_x * tiles_y;
+    // row major order, thread q owns the q-th contiguous run of tiles
+    int dealt = 0;
+    for (int ty = 0; ty < tiles_y; ++ty) {
+      for (int tx = 0; tx < tiles_x; ++tx) {
+        const Tile tile = {(int)i, tx * TILE_SIZE, ty * TILE_SIZE,
+                           std::min(width, (tx + 1) * TILE_SIZE),
+                           std::min(height, (ty + 1) * TILE_SIZE)};
+        const size_t owner = (size_t)dealt * queues.size() / total;
+        queues[owner].tiles.push_back(tile);
+        ++dealt;
+      }
+    }
+    image_tile_counts.push_back(total);
+    count += total;
+  }
+}
+
+TileScheduler::~TileScheduler() {
+  for (size_t q = 0; q < queues.size(); ++q) {
+    pthread_mutex_destroy(&queues[q].mutex);
+  }
+}
+
+bool TileScheduler::pop_front(Queue &queue, Tile &tile) {
+  pthread_mutex_lock(&queue.mutex);
+  const bool found = !queue.tiles.empty();
+  if (found) {
+    tile = queue.tiles.front();
+    queue.tiles.pop_front();
+  }
+  pthread_mutex_unlock(&queue.mutex);
+  return found;
+}
+
+bool TileScheduler::pop_back(Queue &queue, Tile &tile) {
+  pthread_mutex_lock(&queue.mutex);
+  const bool found = !queue.tiles.empty();
+  if (found) {
+    tile = queue.tiles.back();
+    queue.tiles.pop_back();
+  }
+  pthread_mutex_unlock(&queue.mutex);
+  return found;
+}
+
+bool TileScheduler::next(int thread, Tile &tile) {
+  const int size = queues.size();
+  if (pop_front(queues[thread % size], tile)) {
+    return true;
+  }
+  // the victims are visited starting from the next thread so that thieves
+  // spread over the remaining deques
+  for (int v = 1; v < size; ++v) {
+    if (pop_back(queues[(thread + v) % size], tile)) {
+      return true;
+    }
+  }
+  return false;
+}
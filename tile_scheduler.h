@@ -0,0 +1,55 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <deque>
+#include <pthread.h>
+#include <vector>
+
+const int TILE_SIZE = 32;
+
+struct Tile {
+  int image; // index into the sizes the scheduler was created with
+  int x_begin, y_begin, x_end, y_end;
+};
+
+struct ImageSize {
+  int width, height;
+};
+
+// The tiles of an image are dealt to one deque per thread in contiguous
+// runs, so neighbouring tiles share a thread's caches. A thread takes tiles
+// from the front of its own deque and, once it is empty, steals from the
+// back of the others, so threads that got cheap tiles help with the rest.
+// With several images, each one is dealt over all deques after the previous
+// one, so the images tend to complete in order.
+class TileScheduler {
+public:
+  TileScheduler(int width, int height, int thread_count);
+  TileScheduler(const std::vector<ImageSize> &images, int thread_count);
+  ~TileScheduler();
+
+  int tile_count() const { return count; }
+  int tile_count(int image) const { return image_tile_counts[image]; }
+
+  // false once every deque is empty
+  bool next(int thread, Tile &tile);
+
+private:
+  struct Queue {
+    pthread_mutex_t mutex;
+    std::deque<Tile> tiles;
+  };
+
+  TileScheduler(const TileScheduler &);
+  TileScheduler &operator=(const TileScheduler &);
+
+  void deal(const std::vector<ImageSize> &images);
+  bool pop_front(Queue &queue, Tile &tile);
+  bool pop_back(Queue &queue, Tile &tile);
+
+  int count;
+  std::vector<int> image_tile_counts;
+  std::vector<Queue> queues;
+};
+
+#endif // TILE_SCHEDULER_H
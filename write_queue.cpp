@@ -0,0 +1,83 @@
+#include "write_queue.h"
+#include <algorithm>
+#include <stdexcept>
+
+WriteQueue::WriteQueue(int capacity, const ImageWriterOptions &options)
+    : capacity(std::max(1, capacity)), options(options), writing(0),
+      stopping(false) {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&not_empty, NULL);
+  pthread_cond_init(&not_full, NULL);
+  pthread_create(&writer, NULL, writer_main, this);
+}
+
+WriteQueue::~WriteQueue() {
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_signal(&not_empty);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(writer, NULL);
+  pthread_cond_destroy(&not_full);
+  pthread_cond_destroy(&not_empty);
+  pthread_mutex_destroy(&mutex);
+}
+
+void WriteQueue::submit(const std::string &filename, float *radiance,
+                        int width, int height) {
+  pthread_mutex_lock(&mutex);
+  while ((int)frames.size() >= capacity) {
+    pthread_cond_wait(&not_full, &mutex);
+  }
+  frames.push_back({filename, radiance, width, height});
+  pthread_cond_signal(&not_empty);
+  pthread_mutex_unlock(&mutex);
+}
+
+void WriteQueue::finish() {
+  pthread_mutex_lock(&mutex);
+  while (!frames.empty() || writing > 0) {
+    pthread_cond_wait(&not_full, &mutex);
+  }
+  const std::string message = error;
+  error.clear();
+  pthread_mutex_unlock(&mutex);
+  if (!message.empty()) {
+    throw std::runtime_error(message);
+  }
+}
+
+void *WriteQueue::writer_main(void *arg) {
+  WriteQueue *queue = (WriteQueue *)arg;
+  pthread_mutex_lock(&queue->mutex);
+  while (true) {
+    if (queue->frames.empty()) {
+      if (queue->stopping) {
+        break;
+      }
+      pthread_cond_wait(&queue->not_empty, &queue->mutex);
+      continue;
+    }
+    Frame frame = queue->frames.front();
+    queue->frames.pop_front();
+    queue->writing++;
+    pthread_mutex_unlock(&queue->mutex);
+
+    std::string message;
+    try {
+      create_image_writer(frame.filename, queue->options)
+          ->write(frame.filename, frame.radiance, frame.width, frame.height);
+    } catch (const std::exception &e) {
+      message = e.what();
+    }
+    delete[] frame.radiance;
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->writing--;
+    if (queue->error.empty()) {
+      queue->error = message;
+    }
+    pthread_cond_broadcast(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return NULL;
+}
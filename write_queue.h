@@ -0,0 +1,50 @@
+#ifndef WRITE_QUEUE_H
+#define WRITE_QUEUE_H
+
+#include "image_writer.h"
+#include <deque>
+#include <pthread.h>
+#include <string>
+
+// Finished images are handed to a background thread that encodes and writes
+// them while the next camera renders. The queue is bounded so a slow disk
+// holds back the renderer instead of piling up frames in memory.
+class WriteQueue {
+public:
+  // the format of every image follows the extension of its file name
+  WriteQueue(int capacity, const ImageWriterOptions &options);
+  // waits for the queued images, see finish
+  ~WriteQueue();
+
+  // takes ownership of the new[]ed radiance, blocks while the queue is full
+  void submit(const std::string &filename, float *radiance, int width,
+              int height);
+
+  // waits until every image is written and rethrows the first write error
+  void finish();
+
+private:
+  struct Frame {
+    std::string filename;
+    float *radiance;
+    int width, height;
+  };
+
+  WriteQueue(const WriteQueue &);
+  WriteQueue &operator=(const WriteQueue &);
+
+  static void *writer_main(void *arg);
+
+  int capacity;
+  ImageWriterOptions options;
+  std::deque<Frame> frames;
+  int writing; // frames taken off the queue but not written yet
+  std::string error;
+  bool stopping;
+  pthread_t writer;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full; // also signalled when the writer goes idle
+};
+
+#endif // WRITE_QUEUE_H
@@ -0,0 +1,194 @@
+#include "xml_reader.h"
+#include <stdexcept>
+
+namespace {
+
+inline bool is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+inline bool is_name_char(char c) {
+  return !is_space(c) && c != '>' && c != '/' && c != '=' && c != '<';
+}
+
+// position right after the first occurrence of pattern, or end
+const char *skip_past(const char *cursor, const char *end,
+                      const char *pattern) {
+  const size_t length = std::strlen(pattern);
+  while (cursor + length <= end) {
+    if (std::memcmp(cursor, pattern, length) == 0) {
+      return cursor + length;
+    }
+    ++cursor;
+  }
+  return end;
+}
+
+} // namespace
+
+XmlReader::XmlReader(const char *begin, const char *end)
+    : cursor(begin), end(end), pending_end(false) {
+  element_name.begin = element_name.end = begin;
+  attributes = text_span = element_name;
+}
+
+void XmlReader::fail(const char *message) const {
+  throw std::runtime_error(std::string("Error: malformed xml, ") + message);
+}
+
+XmlReader::Event XmlReader::next() {
+  if (pending_end) {
+    pending_end = false;
+    return END;
+  }
+  while (cursor < end) {
+    if (*cursor != '<') {
+      // text up to the next markup, runs of only whitespace are dropped
+      const char *first = cursor;
+      while (cursor < end && *cursor != '<') {
+        ++cursor;
+      }
+      const char *last = cursor;
+      const char *c = first;
+      while (c < last && is_space(*c)) {
+        ++c;
+      }
+      if (c == last) {
+        continue;
+      }
+      text_span.begin = first;
+      text_span.end = last;
+      return TEXT;
+    }
+
+    if (cursor + 4 <= end && std::memcmp(cursor, "<!--", 4) == 0) {
+      cursor = skip_past(cursor + 4, end, "-->");
+      continue;
+    }
+    if (cursor + 9 <= end && std::memcmp(cursor, "<![CDATA[", 9) == 0) {
+      text_span.begin = cursor + 9;
+      cursor = skip_past(text_span.begin, end, "]]>");
+      text_span.end = cursor - 3;
+      return TEXT;
+    }
+    if (cursor + 1 < end && (cursor[1] == '?' || cursor[1] == '!')) {
+      cursor = skip_past(cursor + 2, end, ">");
+      continue;
+    }
+
+    const bool closing = cursor + 1 < end && cursor[1] == '/';
+    cursor += closing ? 2 : 1;
+    element_name.begin = cursor;
+    while (cursor < end && is_name_char(*cursor)) {
+      ++cursor;
+    }
+    element_name.end = cursor;
+    if (element_name.begin == element_name.end) {
+      fail("empty element name");
+    }
+
+    attributes.begin = cursor;
+    // quoted attribute values may contain > and /
+    char quote = 0;
+    while (cursor < end && (quote || *cursor != '>')) {
+      if (quote) {
+        quote = *cursor == quote ? 0 : quote;
+      } else if (*cursor == '"' || *cursor == '\'') {
+        quote = *cursor;
+      }
+      ++cursor;
+    }
+    if (cursor == end) {
+      fail("unterminated tag");
+    }
+    attributes.end = cursor;
+    ++cursor;
+
+    if (closing) {
+      return END;
+    }
+    if (attributes.end > attributes.begin && attributes.end[-1] == '/') {
+      --attributes.end;
+      pending_end = true;
+    }
+    return START;
+  }
+  return DONE;
+}
+
+bool XmlReader::attribute(const char *name, TextSpan &value) const {
+  const char *c = attributes.begin;
+  while (c < attributes.end) {
+    while (c < attributes.end && is_space(*c)) {
+      ++c;
+    }
+    TextSpan key = {c, c};
+    while (c < attributes.end && is_name_char(*c)) {
+      ++c;
+    }
+    key.end = c;
+    while (c < attributes.end && (is_space(*c) || *c == '=')) {
+      ++c;
+    }
+    if (c == attributes.end || (*c != '"' && *c != '\'')) {
+      return false;
+    }
+    const char quote = *c++;
+    value.begin = c;
+    while (c < attributes.end && *c != quote) {
+      ++c;
+    }
+    value.end = c;
+    if (c < attributes.end) {
+      ++c;
+    }
+    if (key == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+TextSpan XmlReader::element_text() {
+  TextSpan text = {element_name.end, element_name.end};
+  bool found = false;
+  int depth = 1;
+  while (depth > 0) {
+    switch (next()) {
+    case START:
+      ++depth;
+      break;
+    case END:
+      --depth;
+      break;
+    case TEXT:
+      // like tinyxml2's GetText, only the first text of the element counts
+      if (depth == 1 && !found) {
+        text = text_span;
+        found = true;
+      }
+      break;
+    case DONE:
+      fail("unexpected end of document");
+    }
+  }
+  return text;
+}
+
+void XmlReader::skip_element() {
+  int depth = 1;
+  while (depth > 0) {
+    switch (next()) {
+    case START:
+      ++depth;
+      break;
+    case END:
+      --depth;
+      break;
+    case TEXT:
+      break;
+    case DONE:
+      fail("unexpected end of document");
+    }
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef XML_READER_H
+#define XML_READER_H
+
+#include <cstring>
+#include <string>
+
+// span of the document, not NUL terminated
+struct TextSpan {
+  const char *begin;
+  const char *end;
+
+  bool operator==(const char *text) const {
+    const size_t length = std::strlen(text);
+    return (size_t)(end - begin) == length &&
+           std::memcmp(begin, text, length) == 0;
+  }
+  bool operator!=(const char *text) const { return !(*this == text); }
+  std::string str() const { return std::string(begin, end); }
+};
+
+// Pull parser over an XML document held in memory. Names, attribute values
+// and text are reported as spans into the document instead of being copied
+// into a tree. Comments, processing instructions and doctypes are skipped,
+// entities are not decoded; that is all the scene files need.
+class XmlReader {
+public:
+  enum Event { START, END, TEXT, DONE };
+
+  XmlReader(const char *begin, const char *end);
+
+  // a self closing element is reported as START followed by END
+  Event next();
+
+  // element name of the last START or END
+  const TextSpan &name() const { return element_name; }
+  // content of the last TEXT, CDATA sections are reported as is
+  const TextSpan &text() const { return text_span; }
+  // attribute of the element of the last START
+  bool attribute(const char *name, TextSpan &value) const;
+
+  // text of the element whose START was just read, up to its END; nested
+  // elements are skipped and an element without text gives an empty span
+  TextSpan element_text();
+  // skips to the END of the element whose START was just read
+  void skip_element();
+
+private:
+  void fail(const char *message) const;
+
+  const char *cursor;
+  const char *end;
+  TextSpan element_name;
+  TextSpan attributes; // between the name and the closing > of a START
+  TextSpan text_span;
+  bool pending_end; // the last START was self closing
+};
+
+#endif // XML_READER_H